@@ -0,0 +1,19 @@
+#!/bin/sh
+# Generate a script of long expressions: <statements> assignments of <terms> terms each over a small
+# set of variables, joined by the operators in <ops> in turn.
+#
+# Usage: bench/genlong.sh <statements> <terms> [ops] > script.cp
+awk -v n="${1:-100}" -v terms="${2:-10000}" -v ops="${3:-+-*/}" 'BEGIN {
+    for (i = 0; i < 100; i++)
+	printf "v%d = %d;\n", i, i + 1
+    for (s = 0; s < n; s++)
+    {
+	line = "sum" s " = v0"
+	for (t = 1; t < terms; t++)
+	{
+	    op = substr(ops, t % length(ops) + 1, 1)
+	    line = line " " op " v" (t * 7 + s) % 100
+	}
+	print line ";"
+    }
+}'
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Generate a synthetic constparser script of roughly the given size in megabytes, shaped like our
+# generated configuration scripts: long variable names, indentation and a mix of literals and
+# references to earlier variables.
+#
+# Usage: bench/genscript.sh <megabytes> > script.cp
+awk -v mb="${1:-100}" 'BEGIN {
+    limit = mb * 1024 * 1024
+    size = 0
+    for (i = 0; size < limit; i++)
+    {
+	if (i < 4)
+	    line = sprintf("        configurationValue%d = %d;", i, 1000 + i)
+	else
+	    line = sprintf("        configurationValue%d = configurationValue%d / %d + configurationValue%d - %d;",
+			   i, i - 1, i % 7 + 1, int(i / 2), i % 1000)
+	print line
+	size += length(line) + 1
+    }
+}'
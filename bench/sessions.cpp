@@ -0,0 +1,154 @@
+// Runs many small scripts the way we do today, one constparser process each, and then as Sessions on a
+// pool of threads in this process, and compares the time per script. Each script is a few hundred
+// statements shaped like our configuration scripts. The two ways must print the same.
+//
+// Build with make bench/sessions and run it from the top directory, as it starts ./constparser. The number
+// of threads can be given as an argument and defaults to one per CPU.
+#include "../cp.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+// Write n scripts of the given number of statements to temporary files, returning their paths.
+std::vector<std::string> MakeScripts(size_t n, size_t statements)
+{
+    std::vector<std::string> paths;
+    for (size_t k = 0; k < n; k++)
+    {
+	char path[] = "/tmp/constparser-bench-XXXXXX";
+	int  fd = mkstemp(path);
+	if (fd < 0)
+	{
+	    perror("mkstemp");
+	    exit(1);
+	}
+	std::string text;
+	for (size_t i = 0; i < statements; i++)
+	{
+	    text += "configurationValue" + std::to_string(i) + " = ";
+	    if (i < 4)
+		text += std::to_string(1000 + i + k) + ";\n";
+	    else
+		text += "configurationValue" + std::to_string(i - 1) + " / " + std::to_string(i % 7 + 1) +
+			" + configurationValue" + std::to_string(i / 2) + " - " + std::to_string(i % 1000) + ";\n";
+	}
+	if (write(fd, text.data(), text.size()) != ssize_t(text.size()))
+	{
+	    perror("write");
+	    exit(1);
+	}
+	close(fd);
+	paths.push_back(path);
+    }
+    return paths;
+}
+
+// Read back everything written to the temporary file f, and close it.
+std::string ReadAll(FILE* f)
+{
+    std::string text;
+    char        buf[65536];
+    rewind(f);
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+    {
+	text.append(buf, n);
+    }
+    fclose(f);
+    return text;
+}
+
+// Run ./constparser on each script in turn and return what they printed.
+std::string RunProcesses(const std::vector<std::string>& paths)
+{
+    FILE* results = tmpfile();
+    for (const std::string& path : paths)
+    {
+	fflush(results);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+	    dup2(fileno(results), STDOUT_FILENO);
+	    execl("./constparser", "constparser", path.c_str(), (char*)nullptr);
+	    _exit(127);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+	    fprintf(stderr, "./constparser failed on %s\n", path.c_str());
+	    exit(1);
+	}
+    }
+    return ReadAll(results);
+}
+
+// Run a Session for each script on threads threads, each writing to a temporary file of its own, and
+// return what they printed.
+std::vector<std::string> RunSessions(const std::vector<std::string>& paths, unsigned threads)
+{
+    std::vector<std::string> outputs(paths.size());
+    std::atomic<size_t>      next{ 0 };
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; t++)
+    {
+	pool.emplace_back(
+	    [&]
+	    {
+		for (size_t k; (k = next++) < paths.size();)
+		{
+		    FILE* f = tmpfile();
+		    {
+			Session session(-1, fileno(f), Options());
+			if (session.Open(paths[k].c_str()))
+			{
+			    session.Parse();
+			}
+		    }
+		    outputs[k] = ReadAll(f);
+		}
+	    });
+    }
+    for (std::thread& t : pool)
+    {
+	t.join();
+    }
+    return outputs;
+}
+
+int main(int argc, char** argv)
+{
+    using Clock = std::chrono::steady_clock;
+    std::vector<std::string> paths = MakeScripts(2000, 200);
+    unsigned                 threads = argc > 1 ? atoi(argv[1]) : 0;
+    if (threads == 0)
+    {
+	threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    auto        start = Clock::now();
+    std::string expected = RunProcesses(paths);
+    std::chrono::duration<double, std::micro> processes = Clock::now() - start;
+
+    start = Clock::now();
+    std::vector<std::string>                  outputs = RunSessions(paths, threads);
+    std::chrono::duration<double, std::micro> sessions = Clock::now() - start;
+    std::string                               got;
+    for (const std::string& o : outputs)
+    {
+	got += o;
+    }
+
+    for (const std::string& path : paths)
+    {
+	unlink(path.c_str());
+    }
+    printf("%zu scripts: %7.1f us each as processes, %7.1f us each as sessions on %u threads%s\n", paths.size(),
+	   processes.count() / paths.size(), sessions.count() / paths.size(), threads,
+	   got == expected ? "" : " (OUTPUT DIFFERS)");
+    return got == expected ? 0 : 1;
+}
@@ -0,0 +1,96 @@
+#include "constparser.h"
+#include "cp.h"
+
+// A Session run embedded, along with the text fed to it that doesn't make up a complete statement yet and
+// the messages of the last evaluation.
+struct cp_session
+{
+    cp_session(const Options& o) : session(-1, -1, o) {}
+
+    Session     session;
+    std::string pending;
+    std::string messages;
+};
+
+cp_session* cp_create(unsigned flags)
+{
+    Options o;
+    o.embedded = true;
+    o.optimize = flags & (CP_OPTIMIZE | CP_FAST_MATH);
+    o.fastMath = flags & CP_FAST_MATH;
+    o.associative = flags & (CP_ASSOCIATIVE_MATH | CP_FAST_MATH);
+    o.engine = flags & CP_JIT ? Engine::Jit : Engine::Vm;
+    return new cp_session(o);
+}
+
+void cp_destroy(cp_session* s)
+{
+    delete s;
+}
+
+void cp_feed(cp_session* s, const char* text, size_t length)
+{
+    s->pending.append(text, length);
+}
+
+size_t cp_evaluate(cp_session* s)
+{
+    // Every statement ends with a ';', so the text up to the last one is complete, unless a syntax error
+    // carries the last statement past it.
+    size_t complete = s->pending.rfind(';') + 1;
+    s->session.Load(std::string_view(s->pending).substr(0, complete));
+    s->session.Parse();
+    s->pending.erase(0, complete - s->session.Unparsed());
+    s->messages = s->session.Messages();
+    return s->session.Results().size();
+}
+
+size_t cp_result_count(const cp_session* s)
+{
+    return s->session.Results().size();
+}
+
+void cp_result(const cp_session* s, size_t i, uint32_t* slot, double* value)
+{
+    *slot = s->session.Results()[i].first;
+    *value = s->session.Results()[i].second;
+}
+
+int cp_slot(const cp_session* s, const char* name, uint32_t* slot)
+{
+    *slot = s->session.Symbols().Lookup(name);
+    return *slot != SymbolTable::NoSlot;
+}
+
+const char* cp_name(const cp_session* s, uint32_t slot, size_t* length)
+{
+    const SymbolTable& symbols = s->session.Symbols();
+    if (slot >= symbols.values.size())
+    {
+	return nullptr;
+    }
+    *length = symbols.Name(slot).size();
+    return symbols.Name(slot).data();
+}
+
+int cp_get(const cp_session* s, const char* name, double* value)
+{
+    uint32_t slot;
+    return cp_slot(s, name, &slot) && cp_get_slot(s, slot, value);
+}
+
+int cp_get_slot(const cp_session* s, uint32_t slot, double* value)
+{
+    const SymbolTable& symbols = s->session.Symbols();
+    if (slot >= symbols.values.size() || !symbols.defined[slot])
+    {
+	return 0;
+    }
+    *value = symbols.values[slot];
+    return 1;
+}
+
+const char* cp_messages(const cp_session* s)
+{
+    return s->messages.c_str();
+}
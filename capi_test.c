@@ -0,0 +1,39 @@
+/* Runs the script on standard input through the C API, feeding it a few bytes at a time so that
+ * statements are split across feeds, and prints each result as name=value. Then prints the value of each
+ * variable named on the command line, and what the parser reported. */
+#include "constparser.h"
+
+#include <stdio.h>
+
+int main(int argc, char** argv)
+{
+    cp_session* s = cp_create(0);
+    char        buf[5];
+    size_t      n;
+    while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+    {
+	cp_feed(s, buf, n);
+	size_t count = cp_evaluate(s);
+	for (size_t i = 0; i < count; i++)
+	{
+	    uint32_t    slot;
+	    double      value;
+	    size_t      length;
+	    const char* name;
+	    cp_result(s, i, &slot, &value);
+	    name = cp_name(s, slot, &length);
+	    printf("%.*s=%g\n", (int)length, name, value);
+	}
+	fputs(cp_messages(s), stdout);
+    }
+    for (int i = 1; i < argc; i++)
+    {
+	double value;
+	if (cp_get(s, argv[i], &value))
+	    printf("%s is %g\n", argv[i], value);
+	else
+	    printf("%s is not set\n", argv[i]);
+    }
+    cp_destroy(s);
+    return 0;
+}
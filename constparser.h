@@ -0,0 +1,65 @@
+/* The C API of libconstparser, for evaluating constparser scripts in-process.
+ *
+ * A session holds the variables of one script. Text is fed to it in pieces of any size, and
+ * cp_evaluate() then runs every complete statement fed so far, that is everything up to the last ';'
+ * unless a syntax error carries a statement on past it. The rest is kept for the next call, so a
+ * statement may be split across feeds. Variables keep their values from one evaluation to the next.
+ *
+ * A session must only be used by one thread at a time, but separate sessions are independent and may
+ * be used on as many threads at once as needed.
+ */
+#ifndef CONSTPARSER_H
+#define CONSTPARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct cp_session cp_session;
+
+/* Flags for cp_create(), the counterparts of the command line options -O, -fassociative-math,
+ * -ffast-math and -e jit. */
+enum
+{
+    CP_OPTIMIZE = 1,
+    CP_ASSOCIATIVE_MATH = 2,
+    CP_FAST_MATH = 4,
+    CP_JIT = 8
+};
+
+cp_session* cp_create(unsigned flags);
+void        cp_destroy(cp_session* s);
+
+/* Append length bytes of script text. */
+void cp_feed(cp_session* s, const char* text, size_t length);
+
+/* Evaluate the complete statements fed since the last call, and return how many there were. */
+size_t cp_evaluate(cp_session* s);
+
+/* The results of the last cp_evaluate(), one per statement in script order: the slot of the variable it
+ * assigned and the value. */
+size_t cp_result_count(const cp_session* s);
+void   cp_result(const cp_session* s, size_t i, uint32_t* slot, double* value);
+
+/* Every variable the script has mentioned has a slot. cp_slot() finds a variable's slot, or returns 0 if
+ * there is no such variable. cp_name() gives back the name of a slot, which is not NUL terminated, or
+ * NULL if there is no such slot. */
+int         cp_slot(const cp_session* s, const char* name, uint32_t* slot);
+const char* cp_name(const cp_session* s, uint32_t slot, size_t* length);
+
+/* The value of a variable, by name or by slot. These return 0 if it has not been assigned. */
+int cp_get(const cp_session* s, const char* name, double* value);
+int cp_get_slot(const cp_session* s, uint32_t slot, double* value);
+
+/* What the last cp_evaluate() reported about the script, such as invalid tokens or variables that were
+ * read before being assigned, one message per line. The text stays valid until the next cp_evaluate(). */
+const char* cp_messages(const cp_session* s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,117 +1,89 @@
+#include "cp.h"
+
+#include <algorithm>
+#include <array>
 #include <cassert>
-#include <cctype>
+#include <cerrno>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <fcntl.h>
 #include <iostream>
-#include <map>
-#include <sstream>
-#include <tuple>
-
-using varmap = std::map<std::string, double>;
-
-class Token
-{
-public:
-    enum Type
-    {
-	Varname,
-	Number,
-	Plus,
-	Minus,
-	Mult,
-	Divide,
-	LParen,
-	RParen,
-	Equal,
-	SemiColon,
-	EndOfFile,
-	Undefined
-    };
-    Type        type;
-    std::string value;
-    Token(const std::string& v, Type t) : type(t), value(v) {}
-    Token(Type t) : type(t) {}
-    Token() : type(Undefined) {}
-    unsigned    Precedence();
-    std::string ToString() const;
-};
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#if defined(__x86_64__) && !defined(CP_NO_SIMD)
+#include <immintrin.h>
+#define CP_SIMD 1
+#endif
 
-class ConstExpr;
-class ConstUnaryExpr;
-
-class Value
+Output& Output::operator<<(std::string_view s)
 {
-public:
-    enum Type
+    buf += s;
+    if (buf.size() >= BufferSize)
     {
-	Constant,
-	Variable,
-	Expr,
-	UnaryExpr,
-	Unknown
-    };
-
-    Value(double d) : type(Constant), value(d) {}
-    Value(const std::string& s) : type(Variable), varname(s) {}
-    Value(ConstExpr* e) : type(Expr), expr(e) {}
-    Value(ConstUnaryExpr* u) : type(UnaryExpr), unary(u) {}
-    Value() : type(Unknown) {}
-
-    ~Value() {}
-
-    double operator()() const;
-
-private:
-    Type type;
-    std::string varname;
-    double      value;
-    ConstExpr*  expr;
-    ConstUnaryExpr* unary;
-};
+	Flush();
+    }
+    return *this;
+}
 
-class ConstUnaryExpr
+Output& Output::operator<<(char c)
 {
-public:
-    ConstUnaryExpr(Token::Type t, const Value r) : op(t), rhs(r) {}
-
-    double Evaluate() const;
-
-private:
-    Token::Type op;
-    const Value rhs;
-};
+    return *this << std::string_view(&c, 1);
+}
 
-class ConstExpr
+Output& Output::operator<<(double d)
 {
-public:
-    ConstExpr(const Value l, Token::Type t, const Value r) : lhs(l), op(t), rhs(r) {}
+    char                 text[32];
+    std::to_chars_result r = exact ? std::to_chars(text, std::end(text), d)
+				   : std::to_chars(text, std::end(text), d, std::chars_format::general, 6);
+    return *this << std::string_view(text, r.ptr - text);
+}
 
-    double Evaluate() const;
+void Output::Flush()
+{
+    if (capture)
+    {
+	return;
+    }
+    for (size_t done = 0; done < buf.size();)
+    {
+	ssize_t n = write(fd, buf.data() + done, buf.size() - done);
+	if (n < 0 && errno == EINTR)
+	{
+	    continue;
+	}
+	if (n < 0)
+	{
+	    // Nowhere to report it; drop the output rather than spin.
+	    break;
+	}
+	done += n;
+    }
+    buf.clear();
+}
 
-private:
-    const Value  lhs;
-    Token::Type  op;
-    const Value  rhs;
-};
+std::string Output::Take()
+{
+    std::string text;
+    text.swap(buf);
+    return text;
+}
 
-std::ostream& operator<<(std::ostream& o, const Token& x)
+Output& operator<<(Output& o, const Token& x)
 {
     o << x.ToString();
     return o;
 }
 
-varmap vars;
-bool   verbose = false;
-Token  curToken;
-bool   curValid = false;
-
 std::string Token::ToString() const
 {
     switch (type)
     {
     case Varname:
-	return "String: '" + value + "'";
+	return "String: '" + std::string(value) + "'";
     case Number:
-	return "Number: " + value;
+	return "Number: " + std::string(value);
     case Plus:
 	return "Plus";
     case Minus:
@@ -135,350 +107,2726 @@ std::string Token::ToString() const
     }
 }
 
-std::tuple<bool, double> FindVar(const std::string& name)
+// Hashes eight bytes at a time, multiplying each word in and folding the high half of the product back.
+uint32_t SymbolTable::Hash(std::string_view name)
 {
-    varmap::iterator it = vars.find(name);
-    if (it != vars.end())
-	return { true, it->second };
-    std::cout << "Invalid variable " << name << std::endl;
-    return { false, 0.0 };
+    const uint64_t k = 0x9e3779b97f4a7c15;
+    uint64_t       h = name.size() * k;
+    const char*    p = name.data();
+    size_t         n = name.size();
+    for (; n >= 8; p += 8, n -= 8)
+    {
+	uint64_t w;
+	memcpy(&w, p, 8);
+	h = (h ^ w) * k;
+	h ^= h >> 32;
+    }
+    if (n != 0)
+    {
+	uint64_t w = 0;
+	memcpy(&w, p, n);
+	h = (h ^ w) * k;
+	h ^= h >> 32;
+    }
+    h *= k;
+    return h >> 32;
 }
 
-double ConstUnaryExpr::Evaluate() const
+uint32_t SymbolTable::Intern(std::string_view name)
 {
-    switch (op)
+    uint32_t hash = Hash(name);
+    size_t   mask = table.size() - 1;
+    size_t   i = hash & mask;
+    for (; table[i].slot != NoSlot; i = (i + 1) & mask)
     {
-    case Token::Plus:
-	return rhs();
-
-    case Token::Minus:
-	return -rhs();
-
-    default:
-	std::cout << "Unknown operation: " << op << std::endl;
-	return 0;
+	if (table[i].hash == hash && names[table[i].slot] == name)
+	{
+	    return table[i].slot;
+	}
     }
+    uint32_t slot = names.size();
+    table[i] = { hash, slot };
+    names.push_back(Store(name));
+    values.push_back(0.0);
+    defined.push_back(false);
+    versions.push_back(1);
+    if (names.size() * 2 > table.size())
+    {
+	Grow();
+    }
+    return slot;
 }
 
-double ConstExpr::Evaluate() const
+// The slot of name, or NoSlot if it has never been interned.
+uint32_t SymbolTable::Lookup(std::string_view name) const
 {
-    switch (op)
+    uint32_t hash = Hash(name);
+    size_t   mask = table.size() - 1;
+    for (size_t i = hash & mask; table[i].slot != NoSlot; i = (i + 1) & mask)
     {
-    case Token::Plus:
-	return lhs() + rhs();
-    case Token::Minus:
-	return lhs() - rhs();
-    case Token::Mult:
-	return lhs() * rhs();
-    case Token::Divide:
-	return lhs() / rhs();
-    default:
-	std::cout << "Unknown operation: " << op << std::endl;
-	return 0;
+	if (table[i].hash == hash && names[table[i].slot] == name)
+	{
+	    return table[i].slot;
+	}
     }
+    return NoSlot;
 }
 
-double Value::operator()() const
+void SymbolTable::Grow()
 {
-    switch (type)
-    {
-    case Constant:
-	return value;
-
-    case Variable:
+    std::vector<Entry> old(table.size() * 2, Entry{ 0, NoSlot });
+    old.swap(table);
+    size_t mask = table.size() - 1;
+    for (const Entry& e : old)
     {
-	auto [found, value] = FindVar(varname);
-	if (found)
-	    return value;
-	return 0.0;
+	if (e.slot == NoSlot)
+	{
+	    continue;
+	}
+	size_t i = e.hash & mask;
+	while (table[i].slot != NoSlot)
+	{
+	    i = (i + 1) & mask;
+	}
+	table[i] = e;
     }
-    case Expr:
+}
+
+// Copy name into the current block, starting a new one when it doesn't fit.
+std::string_view SymbolTable::Store(std::string_view name)
+{
+    if (name.size() > blockLeft || blockNext == nullptr)
     {
-	return expr->Evaluate();
+	size_t size = std::max(BlockSize, name.size());
+	blocks.emplace_back(new char[size]);
+	blockNext = blocks.back().get();
+	blockLeft = size;
     }
-    case UnaryExpr:
+    if (!name.empty())
     {
-	return unary->Evaluate();
-    }
-    case Unknown:
-	assert(0 && "Uninitielized value");
-	return 0.0;
+	memcpy(blockNext, name.data(), name.size());
     }
+    std::string_view stored(blockNext, name.size());
+    blockNext += name.size();
+    blockLeft -= name.size();
+    return stored;
 }
 
-unsigned Token::Precedence()
+// The value of slot, and whether it has been assigned. Reading one that hasn't been is reported on out.
+std::tuple<bool, double> SymbolTable::Find(uint32_t slot, Output& out) const
 {
-    switch (type)
+    if (defined[slot])
+	return { true, values[slot] };
+    out << "Invalid variable " << Name(slot) << '\n';
+    return { false, 0.0 };
+}
+
+void SymbolTable::Assign(uint32_t slot, double value)
+{
+    values[slot] = value;
+    defined[slot] = true;
+    versions[slot] = ++version;
+}
+
+// What a node is hash-consed by besides its op: its operands, or for a Constant the bits of its value.
+uint64_t Ast::Key(NodeId n) const
+{
+    if (op[n] == Constant)
     {
-    case Token::Mult:
-    case Token::Divide:
-	return 2;
-    case Token::Plus:
-    case Token::Minus:
-	return 1;
-    default:
-	return 0;
+	uint64_t bits;
+	memcpy(&bits, &constants[lhs[n]], sizeof(bits));
+	return bits;
     }
+    return uint64_t(lhs[n]) << 32 | rhs[n];
 }
 
-Token GetNextToken()
+// Where the node for o and key would go in the hash table if nothing were in the way.
+size_t Ast::Home(Op o, uint64_t key) const
 {
-    std::string v;
-    for (;;)
+    size_t h = (key ^ uint64_t(o) << 59) * 0x9e3779b97f4a7c15;
+    return h >> 32 & (table.size() - 1);
+}
+
+// The slot of the hash table that holds the node for o and key, or the empty slot where it belongs.
+size_t Ast::Lookup(Op o, uint64_t key) const
+{
+    size_t mask = table.size() - 1;
+    for (size_t i = Home(o, key);; i = (i + 1) & mask)
     {
-	int ch = std::cin.get();
-	if (ch == EOF)
-	{
-	    return Token::EndOfFile;
-	}
-	if (isspace(ch))
-	{
-	    continue;
-	}
-	if (isalpha(ch))
-	{
-	    while (isalnum(ch))
-	    {
-		v += ch;
-		ch = std::cin.get();
-	    }
-	    std::cin.putback(ch);
-	    return Token(v, Token::Varname);
-	}
-	if (isdigit(ch))
+	NodeId n = table[i];
+	if (n == NoNode || (op[n] == o && Key(n) == key))
 	{
-	    while (isdigit(ch))
-	    {
-		v += ch;
-		ch = std::cin.get();
-	    }
-	    std::cin.putback(ch);
-	    return Token(v, Token::Number);
+	    return i;
 	}
-	switch (ch)
+    }
+}
+
+void Ast::Rehash(size_t size)
+{
+    table.assign(size, NoNode);
+    tableUsed = 0;
+    for (NodeId n = 0; n < op.size(); n++)
+    {
+	size_t slot = Lookup(op[n], Key(n));
+	if (table[slot] == NoNode)
 	{
-	case '+':
-	    return Token(Token::Plus);
-	case '-':
-	    return Token(Token::Minus);
-	case '*':
-	    return Token(Token::Mult);
-	case '/':
-	    return Token(Token::Divide);
-	case '=':
-	    return Token(Token::Equal);
-	case '(':
-	    return Token(Token::LParen);
-	case ')':
-	    return Token(Token::RParen);
-	case ';':
-	    return Token(Token::SemiColon);
-	default:
-	    std::cout << "Uh? found character '" << ch << "' which doesn't seem to be useful here"
-	              << std::endl;
-	    break;
+	    table[slot] = n;
+	    tableUsed++;
 	}
     }
 }
 
-Token GetToken()
+// Add a node that Lookup() didn't find at slot.
+NodeId Ast::Insert(size_t slot, Op o, uint32_t l, uint32_t r)
 {
-    if (!curValid)
+    op.push_back(o);
+    lhs.push_back(l);
+    rhs.push_back(r);
+    shared.push_back(false);
+    NodeId n = op.size() - 1;
+    table[slot] = n;
+    if (++tableUsed * 2 > table.size())
     {
-	curToken = GetNextToken();
-	curValid = true;
+	Rehash(table.size() * 2);
     }
-    return curToken;
+    return n;
 }
 
-void NextToken()
+// Return the node l o r, making it if it doesn't exist yet. An existing node is marked shared, as whoever
+// made it may still refer to it, which keeps Drop() from removing it.
+NodeId Ast::Append(Op o, uint32_t l, uint32_t r)
 {
-    curValid = false;
+    size_t slot = Lookup(o, uint64_t(l) << 32 | r);
+    if (table[slot] != NoNode)
+    {
+	shared[table[slot]] = true;
+	return table[slot];
+    }
+    return Insert(slot, o, l, r);
 }
 
-double ToDouble(const std::string& val)
+NodeId Ast::MakeConstant(double d)
 {
-    double       d;
-    std::stringstream ss(val);
-    if (ss >> d)
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    size_t slot = Lookup(Constant, bits);
+    if (table[slot] != NoNode)
     {
-	return d;
+	shared[table[slot]] = true;
+	return table[slot];
     }
-    std::cout << "Invalid number, replacing with -1" << std::endl;
-    return -1.0;
+    constants.push_back(d);
+    return Insert(slot, Constant, constants.size() - 1, 0);
 }
 
-bool Expect(Token::Type ty, Token& t)
+NodeId Ast::MakeVariable(uint32_t slot)
 {
-    t = GetToken();
-    NextToken();
-    if (t.type != ty && t.type != Token::EndOfFile)
+    return Append(Variable, slot, 0);
+}
+
+// Remove node n again if it is the last one, along with its constant, unless it is shared. Folding uses
+// this on the operands it has consumed, and as those are normally the most recent nodes, it leaves no dead
+// nodes behind.
+void Ast::Drop(NodeId n)
+{
+    if (n != op.size() - 1 || shared[n])
     {
-	std::cout << "Invalid token, expected: " << Token(ty) << " got " << t << std::endl;
-	return false;
+	return;
+    }
+    Unlink(n);
+    if (op[n] == Constant && lhs[n] == constants.size() - 1)
+    {
+	constants.pop_back();
+    }
+    op.pop_back();
+    lhs.pop_back();
+    rhs.pop_back();
+    shared.pop_back();
+    if (memo.size() > n)
+    {
+	memo.resize(n);
+	version.resize(n);
+	evaluations.resize(n);
     }
-    return true;
 }
 
-Value ParseValue(int prec);
-
-Value ParseSimpleExpr()
+// Take n out of the hash table. The entries after it in the same run move back to close the gap, unless
+// that would put one before its home slot, so that every probe still finds what it is looking for. Were
+// dropped nodes left in the table instead, folding the same constant over and over would pile up stale
+// entries in front of it, and each lookup would take longer than the last.
+void Ast::Unlink(NodeId n)
 {
-    Token t = GetToken();
-    switch (t.type)
+    size_t mask = table.size() - 1;
+    size_t i = Lookup(op[n], Key(n));
+    if (table[i] != n)
     {
-    case Token::Number:
-	NextToken();
-	return Value(ToDouble(t.value));
+	return;
+    }
+    for (size_t j = (i + 1) & mask; table[j] != NoNode; j = (j + 1) & mask)
+    {
+	size_t home = Home(op[table[j]], Key(table[j]));
+	if (((j - home) & mask) >= ((j - i) & mask))
+	{
+	    table[i] = table[j];
+	    i = j;
+	}
+    }
+    table[i] = NoNode;
+    tableUsed--;
+}
 
-    case Token::Varname:
-	NextToken();
-	return Value(t.value);
+double Ast::Apply(Op o, double l, double r)
+{
+    switch (o)
+    {
+    case Add:
+	return l + r;
+    case Sub:
+	return l - r;
+    case Mul:
+	return l * r;
+    case Div:
+	return l / r;
+    default:
+	assert(0 && "Not a binary operation");
+	return 0;
+    }
+}
 
+NodeId Ast::MakeUnary(Token::Type t, NodeId r)
+{
+    switch (t)
+    {
     case Token::Plus:
+	return r;
     case Token::Minus:
-	NextToken();
-	return Value(new ConstUnaryExpr(t.type, ParseSimpleExpr()));
-
-    case Token::EndOfFile:
-    case Token::SemiColon:
-	break;
+	return Negate(r);
+    default:
+	assert(0 && "Unknown unary operation");
+	return r;
+    }
+}
 
+NodeId Ast::MakeBinary(Token::Type t, NodeId l, NodeId r)
+{
+    switch (t)
+    {
+    case Token::Plus:
+	return Binary(Add, l, r);
+    case Token::Minus:
+	return Binary(Sub, l, r);
+    case Token::Mult:
+	return Binary(Mul, l, r);
+    case Token::Divide:
+	return Binary(Div, l, r);
     default:
-	std::cout << "Unknown value" << std::endl;
-	break;
+	assert(0 && "Unknown binary operation");
+	return l;
     }
-    return Value(0.0);
 }
 
-Value ParseRhs(Value lhs, unsigned prec)
+// Negation folds constants and cancels out, so a chain like - - - x becomes a single Neg. Both are exact,
+// whatever the operand's value.
+NodeId Ast::Negate(NodeId r)
 {
-    for (;;)
+    if (op[r] == Constant)
     {
-	Token t = GetToken();
+	double d = -constants[lhs[r]];
+	Drop(r);
+	return MakeConstant(d);
+    }
+    if (op[r] == Neg)
+    {
+	NodeId x = lhs[r];
+	Drop(r);
+	return x;
+    }
+    return Append(Neg, r, 0);
+}
 
-	if (t.type == Token::SemiColon)
+// An operation on two constants is done right away. That gives exactly the result evaluation would, as
+// it's the same operation on the same doubles.
+NodeId Ast::Binary(Op o, NodeId l, NodeId r)
+{
+    if (op[l] == Constant && op[r] == Constant)
+    {
+	double d = Apply(o, constants[lhs[l]], constants[lhs[r]]);
+	Drop(r);
+	Drop(l);
+	return MakeConstant(d);
+    }
+    if (options.optimize)
+    {
+	NodeId n = Simplify(o, l, r);
+	if (n != NoNode)
 	{
-	    return lhs;
+	    return n;
 	}
+    }
+    return Append(o, l, r);
+}
+
+// Whether n is the constant d, telling +0 and -0 apart.
+bool Ast::IsConstant(NodeId n, double d) const
+{
+    return op[n] == Constant && constants[lhs[n]] == d && std::signbit(constants[lhs[n]]) == std::signbit(d);
+}
 
-	unsigned curPrec = t.Precedence();
-	if (curPrec < prec)
+// Rewrite l o r using an algebraic identity, or return NoNode if none applies. Without -ffast-math only
+// identities that give exactly the same result for every operand are used, infinities, NaNs and signed
+// zeros included: x + -0, x - 0, x * 1 and x / 1 are x, x * 2 becomes x + x for a variable x, and division
+// by a power of two becomes multiplication by its reciprocal. -ffast-math adds x + 0 = x, x * 0 = 0,
+// 0 - x = -x, x - x = 0, x / x = 1, multiplying by the reciprocal of any constant, and x * -1 = -x,
+// x + -y = x - y and x - -y = x + y. Those last three differ for a NaN: arithmetic passes a NaN operand
+// on as it is, whereas negating it flips its sign. As nodes are hash-consed, x - x and x / x catch any
+// repeated subexpression x.
+//
+// A rewrite never swaps the operands, so that they stay in the order the statement computes them.
+NodeId Ast::Simplify(Op o, NodeId l, NodeId r)
+{
+    switch (o)
+    {
+    case Add:
+	if (IsConstant(r, -0.0) || (options.fastMath && IsConstant(r, 0.0)))
 	{
-	    return lhs;
+	    Drop(r);
+	    return l;
 	}
-	NextToken();
+	if (IsConstant(l, -0.0) || (options.fastMath && IsConstant(l, 0.0)))
+	{
+	    return r;
+	}
+	if (options.fastMath && op[r] == Neg)
+	{
+	    NodeId y = lhs[r];
+	    Drop(r);
+	    return Binary(Sub, l, y);
+	}
+	break;
 
-	Value rhs = ParseSimpleExpr();
+    case Sub:
+	if (IsConstant(r, 0.0))
+	{
+	    Drop(r);
+	    return l;
+	}
+	if (options.fastMath && op[r] == Neg)
+	{
+	    NodeId y = lhs[r];
+	    Drop(r);
+	    return Binary(Add, l, y);
+	}
+	if (options.fastMath && IsConstant(l, 0.0))
+	{
+	    return Negate(r);
+	}
+	if (options.fastMath && l == r)
+	{
+	    Drop(r);
+	    Drop(l);
+	    return MakeConstant(0.0);
+	}
+	break;
 
-	if (verbose)
+    case Mul:
+	if (IsConstant(r, 1.0))
+	{
+	    Drop(r);
+	    return l;
+	}
+	if (IsConstant(l, 1.0))
 	{
-	    std::cout << "Token: " << t << std::endl;
+	    return r;
 	}
-	switch (t.type)
+	if (options.fastMath && IsConstant(r, -1.0))
 	{
-	case Token::Plus:
-	case Token::Minus:
-	case Token::Mult:
-	case Token::Divide:
+	    Drop(r);
+	    return Negate(l);
+	}
+	if (options.fastMath && IsConstant(l, -1.0))
+	{
+	    return Negate(r);
+	}
+	if (IsConstant(r, 2.0) && op[l] == Variable)
+	{
+	    Drop(r);
+	    return Append(Add, l, l);
+	}
+	if (options.fastMath && (op[l] == Constant || op[r] == Constant) &&
+	    (IsConstant(l, 0.0) || IsConstant(r, 0.0) || IsConstant(l, -0.0) || IsConstant(r, -0.0)))
+	{
+	    Drop(r);
+	    Drop(l);
+	    return MakeConstant(0.0);
+	}
+	break;
+
+    case Div:
+	if (IsConstant(r, 1.0))
+	{
+	    Drop(r);
+	    return l;
+	}
+	if (op[r] == Constant)
 	{
-	    unsigned next = GetToken().Precedence();
-	    if (curPrec < next)
+	    // The reciprocal of a power of two is exact, so multiplying by it rounds just like dividing.
+	    double c = constants[lhs[r]];
+	    double recip = 1 / c;
+	    int    exp;
+	    if ((options.fastMath && c != 0) ||
+		(std::fabs(std::frexp(c, &exp)) == 0.5 && std::isfinite(recip) && recip != 0))
 	    {
-		rhs = ParseRhs(rhs, next);
+		Drop(r);
+		return Append(Mul, l, MakeConstant(recip));
 	    }
-	    lhs = Value(new ConstExpr(lhs, t.type, rhs));
-	    break;
 	}
-
-	case Token::Equal:
+	if (options.fastMath && l == r)
 	{
-	    std::cout << "Error: Unexpected '='" << std::endl;
-	    NextToken();
-	    break;
+	    Drop(r);
+	    Drop(l);
+	    return MakeConstant(1.0);
 	}
+	break;
 
-	case Token::EndOfFile:
-	    return Value(-1);
-
-	case Token::SemiColon:
-	    return lhs;
-
-	default:
-	    std::cout << "Error, unknown token" << std::endl;
-	    NextToken();
-	    break;
-	}
+    default:
+	break;
     }
+    return NoNode;
 }
 
-Value ParseExpr()
+void Ast::Clear()
 {
-    Value lhs = ParseSimpleExpr();
-    if (GetToken().type == Token::SemiColon)
+    // Size the table for a statement like this one, so that similar statements don't rehash.
+    size_t size = 64;
+    while (size < op.size() * 4)
     {
-	return lhs;
+	size *= 2;
     }
-    return ParseRhs(lhs, 0);
+    table.assign(size, NoNode);
+    tableUsed = 0;
+    op.clear();
+    lhs.clear();
+    rhs.clear();
+    constants.clear();
+    memo.clear();
+    version.clear();
+    evaluations.clear();
+    shared.clear();
 }
 
-void Parse()
+// Rebuild the expression at root with every chain of additions, and every chain of multiplications, made
+// into a balanced tree. The parser makes a + b + c + d into ((a + b) + c) + d, where each addition waits
+// for the one before; as (a + b) + (c + d) the longest such chain is log2 n rather than n - 1 operations
+// long, and the CPU can overlap the rest. Summing pairwise like that usually loses less precision too, but
+// the result can round differently, so this is only done with -fassociative-math. The constants of a chain
+// are combined into one, which goes last.
+//
+// A node used more than once ends a chain, so that it stays shared. Only the nodes root uses are rebuilt,
+// so nodes that folding and simplification left dead don't carry over.
+NodeId Ast::Reassociate(NodeId root)
 {
-    Token v;
-    do
+    Ast old = std::move(*this);
+    Clear();
+
+    std::vector<uint32_t> uses(root + 1, 0);
+    std::vector<uint8_t>  inner(root + 1, false);
+    uses[root] = 1;
+    for (NodeId i = root + 1; i-- > 0;)
     {
-	if (Expect(Token::Varname, v))
+	if (uses[i] && old.op[i] >= Neg)
 	{
-	    if (verbose)
-	    {
-		std::cout << v << std::endl;
-	    }
-	    Token e;
-	    if (Expect(Token::Equal, e))
-	    {
-		Value val = ParseExpr();
-		NextToken();
-		vars[v.value] = val();
-		std::cout << "val=" << val() << std::endl;
-	    }
+	    uses[old.lhs[i]]++;
+	    uses[old.rhs[i]] += old.op[i] != Neg;
 	}
-    } while (v.type != Token::EndOfFile);
-}
-
-void Usage(const std::string& msg, const std::string& option = "")
-{
-    if (msg != "")
+    }
+    for (NodeId i = 0; i <= root; i++)
     {
-	std::cerr << msg;
-	if (option != "")
+	if (uses[i] && (old.op[i] == Add || old.op[i] == Mul))
 	{
-	    std::cerr << ":" << option;
+	    for (NodeId x : { old.lhs[i], old.rhs[i] })
+	    {
+		inner[x] |= old.op[x] == old.op[i] && uses[x] == 1;
+	    }
 	}
-	std::cerr << "\n\n";
     }
-    std::cerr << "Options available:\n";
-    std::cerr << "-v     Enable verbose mode" << std::endl;
-}
 
-int main(int argc, char** argv)
-{
-    for (int i = 1; i < argc; i++)
+    std::vector<NodeId> map(root + 1, NoNode);
+    std::vector<NodeId> work;
+    std::vector<NodeId> terms;
+    for (NodeId i = 0; i <= root; i++)
     {
-	if (argv[i][0] != '-')
+	if (!uses[i] || inner[i])
 	{
-	    Usage("Not an option", argv[i]);
-	    exit(1);
-	}
-	const std::string a = argv[i];
-	if (a == "-v")
-	{
-	    verbose = true;
+	    continue;
 	}
-	else
+	Op o = old.op[i];
+	switch (o)
 	{
-	    Usage("Invalid option", a);
+	case Constant:
+	    map[i] = MakeConstant(old.constants[old.lhs[i]]);
+	    break;
+	case Variable:
+	    map[i] = MakeVariable(old.lhs[i]);
+	    break;
+	case Neg:
+	    map[i] = Negate(map[old.lhs[i]]);
+	    break;
+	case Sub:
+	case Div:
+	    map[i] = Binary(o, map[old.lhs[i]], map[old.rhs[i]]);
+	    break;
+	case Add:
+	case Mul:
+	{
+	    // Collect the terms of the chain from left to right.
+	    terms.clear();
+	    work.assign(1, i);
+	    bool   folded = false;
+	    double c = 0;
+	    while (!work.empty())
+	    {
+		NodeId n = work.back();
+		work.pop_back();
+		if (n == i || inner[n])
+		{
+		    work.push_back(old.rhs[n]);
+		    work.push_back(old.lhs[n]);
+		}
+		else if (op[map[n]] == Constant)
+		{
+		    double d = constants[lhs[map[n]]];
+		    c = folded ? Apply(o, c, d) : d;
+		    folded = true;
+		}
+		else
+		{
+		    terms.push_back(map[n]);
+		}
+	    }
+	    if (folded)
+	    {
+		terms.push_back(MakeConstant(c));
+	    }
+	    while (terms.size() > 1)
+	    {
+		size_t k = 0;
+		for (size_t j = 0; j + 1 < terms.size(); j += 2)
+		{
+		    terms[k++] = Binary(o, terms[j], terms[j + 1]);
+		}
+		if (terms.size() % 2)
+		{
+		    terms[k++] = terms.back();
+		}
+		terms.resize(k);
+	    }
+	    map[i] = terms[0];
+	    break;
+	}
+	}
+	if (uses[i] > 1)
+	{
+	    shared[map[i]] = true;
+	}
+    }
+    return map[root];
+}
+
+// Mark the nodes root uses, directly or not, in live. Error recovery can leave nodes behind that nothing
+// refers to, and those must not be evaluated, or a variable in them would be reported as invalid.
+void Ast::Mark(NodeId root)
+{
+    live.assign(root + 1, false);
+    live[root] = true;
+    for (NodeId i = root + 1; i-- > 0;)
+    {
+	if (live[i] && op[i] >= Neg)
+	{
+	    live[lhs[i]] = true;
+	    live[rhs[i]] |= op[i] != Neg;
+	}
+    }
+}
+
+double Ast::Evaluate(NodeId root)
+{
+    // Only the ast engine evaluates, so only it pays for the memo: nodes made since the last evaluation
+    // get theirs here, as never computed.
+    memo.resize(op.size());
+    version.resize(op.size(), 0);
+    evaluations.resize(op.size(), 0);
+    double* r = memo.data();
+    Mark(root);
+    for (NodeId i = 0; i <= root; i++)
+    {
+	if (!live[i])
+	{
+	    continue;
+	}
+	// Constants are version 1, the same as a variable that has never been assigned, so a fresh node
+	// (version 0) is always computed.
+	uint64_t in = 1;
+	switch (op[i])
+	{
+	case Constant:
+	    break;
+	case Variable:
+	    in = symbols.versions[lhs[i]];
+	    break;
+	case Neg:
+	    in = version[lhs[i]];
+	    break;
+	default:
+	    in = std::max(version[lhs[i]], version[rhs[i]]);
+	    break;
+	}
+	if (in <= version[i])
+	{
+	    continue;
+	}
+	version[i] = in;
+	evaluations[i]++;
+	switch (op[i])
+	{
+	case Constant:
+	    r[i] = constants[lhs[i]];
+	    break;
+	case Variable:
+	{
+	    auto [found, value] = symbols.Find(lhs[i], out);
+	    r[i] = value;
+	    break;
+	}
+	case Neg:
+	    r[i] = -r[lhs[i]];
+	    break;
+	case Add:
+	    r[i] = r[lhs[i]] + r[rhs[i]];
+	    break;
+	case Sub:
+	    r[i] = r[lhs[i]] - r[rhs[i]];
+	    break;
+	case Mul:
+	    r[i] = r[lhs[i]] * r[rhs[i]];
+	    break;
+	case Div:
+	    r[i] = r[lhs[i]] / r[rhs[i]];
+	    break;
+	}
+    }
+    return r[root];
+}
+
+// List the nodes the last Evaluate(root) went through.
+void Ast::PrintEvaluations(NodeId root) const
+{
+    static const char* const names[] = { "Constant", "Variable", "Neg", "Add", "Sub", "Mul", "Div" };
+    for (NodeId i = 0; i <= root; i++)
+    {
+	if (!live[i])
+	{
+	    continue;
+	}
+	out << "Node " << i << " " << names[op[i]] << ": evaluated " << evaluations[i] << " times"
+		  << '\n';
+    }
+}
+
+// Compile the expression at root followed by a store to target. The nodes root uses are emitted in
+// postorder, walking the DAG with an explicit stack as expressions can be very deep. An operation used more
+// than once is computed the first time and saved with Tee, and later uses load it back; constants and
+// variables are cheaper to load again. References to variables that are not yet defined are reported here
+// rather than on every run.
+void Code::Compile(const Ast& ast, NodeId root, uint32_t target)
+{
+    code.clear();
+    constants = ast.constants;
+    uses.assign(root + 1, 0);
+    uses[root] = 1;
+    for (NodeId i = root + 1; i-- > 0;)
+    {
+	if (uses[i] && ast.op[i] >= Ast::Neg)
+	{
+	    uses[ast.lhs[i]]++;
+	    uses[ast.rhs[i]] += ast.op[i] != Ast::Neg;
+	}
+    }
+
+    temp.assign(root + 1, NoTemp);
+    uint32_t saved = 0;
+    size_t   depth = 0;
+    size_t   maxDepth = 0;
+    work.clear();
+    if (ast.op[root] >= Ast::Neg)
+    {
+	work.push_back({ root, 0 });
+    }
+    else
+    {
+	Load(ast, root);
+	maxDepth = ++depth;
+    }
+    // Each entry is an operation and how many of its operands have been emitted. Operands that are loaded
+    // rather than computed are emitted right away.
+    while (!work.empty())
+    {
+	NodeId  i = work.back().first;
+	uint8_t done = work.back().second++;
+	if (done < (ast.op[i] == Ast::Neg ? 1 : 2))
+	{
+	    NodeId x = done == 0 ? ast.lhs[i] : ast.rhs[i];
+	    if (ast.op[x] >= Ast::Neg && temp[x] == NoTemp)
+	    {
+		work.push_back({ x, 0 });
+	    }
+	    else
+	    {
+		Load(ast, x);
+		maxDepth = std::max(maxDepth, ++depth);
+	    }
+	    continue;
+	}
+	work.pop_back();
+	switch (ast.op[i])
+	{
+	case Ast::Neg:
+	    Emit(Neg);
+	    break;
+	case Ast::Add:
+	    Emit(Add);
+	    depth--;
+	    break;
+	case Ast::Sub:
+	    Emit(Sub);
+	    depth--;
+	    break;
+	case Ast::Mul:
+	    Emit(Mul);
+	    depth--;
+	    break;
+	case Ast::Div:
+	    Emit(Div);
+	    depth--;
+	    break;
+	default:
+	    break;
+	}
+	if (uses[i] > 1)
+	{
+	    temp[i] = saved++;
+	    Emit(Tee, temp[i]);
+	}
+    }
+    assert(depth == 1);
+    Emit(Store, target);
+    stack.resize(maxDepth);
+    temps.resize(saved);
+    if (check)
+    {
+	Report();
+    }
+}
+
+// Push the value of n: a constant, a variable or an operation already saved in a temporary.
+void Code::Load(const Ast& ast, NodeId n)
+{
+    if (temp[n] != NoTemp)
+    {
+	Emit(LoadTemp, temp[n]);
+    }
+    else if (ast.op[n] == Ast::Constant)
+    {
+	Emit(PushConst, ast.lhs[n]);
+    }
+    else
+    {
+	Emit(LoadVar, ast.lhs[n]);
+    }
+}
+
+// Report each variable the code reads before it is assigned once, in the order of its first load, as
+// Ast::Evaluate() does. A variable is loaded straight from its slot wherever it is an operand, so it can
+// appear many times.
+void Code::Report()
+{
+    unassigned.clear();
+    for (size_t i = 0; i < code.size(); i++)
+    {
+	if (code[i].op == LoadVar && !symbols.defined[code[i].arg])
+	{
+	    unassigned.push_back({ code[i].arg, i });
+	}
+    }
+    if (unassigned.empty())
+    {
+	return;
+    }
+    std::stable_sort(unassigned.begin(), unassigned.end(),
+		     [](const auto& a, const auto& b) { return a.first < b.first; });
+    unassigned.erase(std::unique(unassigned.begin(), unassigned.end(),
+				 [](const auto& a, const auto& b) { return a.first == b.first; }),
+		     unassigned.end());
+    std::sort(unassigned.begin(), unassigned.end(),
+	      [](const auto& a, const auto& b) { return a.second < b.second; });
+    for (const auto& [slot, at] : unassigned)
+    {
+	symbols.Find(slot, out);
+    }
+}
+
+// The interpreter keeps the top of the stack in a local and dispatches with computed gotos (a GNU extension
+// that clang and gcc both support), which lets each handler jump straight to the next.
+double Code::Run()
+{
+    double result = Exec(code.data(), constants.data(), symbols.values.data(), stack.data(), temps.data());
+    symbols.Assign(code.back().arg, result);
+    return result;
+}
+
+// Run the instructions at ip and return the value their Store would store, which is left to the caller.
+double Code::Exec(const Instr* ip, const double* constants, const double* vars, double* stack, double* temps)
+{
+    static const void* const dispatch[] = { &&pushConst, &&loadVar, &&loadTemp, &&tee, &&neg,
+					    &&add,       &&sub,     &&mul,      &&div, &&store };
+    double* sp = stack;
+    double  tos = 0;
+#define NEXT goto* dispatch[(++ip)->op]
+    goto* dispatch[ip->op];
+pushConst:
+    *sp++ = tos;
+    tos = constants[ip->arg];
+    NEXT;
+loadVar:
+    *sp++ = tos;
+    tos = vars[ip->arg];
+    NEXT;
+loadTemp:
+    *sp++ = tos;
+    tos = temps[ip->arg];
+    NEXT;
+tee:
+    temps[ip->arg] = tos;
+    NEXT;
+neg:
+    tos = -tos;
+    NEXT;
+add:
+    tos = *--sp + tos;
+    NEXT;
+sub:
+    tos = *--sp - tos;
+    NEXT;
+mul:
+    tos = *--sp * tos;
+    NEXT;
+div:
+    tos = *--sp / tos;
+    NEXT;
+store:
+#undef NEXT
+    return tos;
+}
+
+// Append the statement compiled in c. Its variable references become references to the statements that
+// last assigned them, and the statement becomes the last assignment of its target.
+void Program::Add(const Code& c)
+{
+    uint32_t self = starts.size() + 1;
+    uint32_t first = deps.size();
+    starts.push_back(code.size());
+    lastDef.resize(symbols.values.size(), 0);
+    for (Code::Instr in : c.code)
+    {
+	switch (in.op)
+	{
+	case Code::PushConst:
+	    in.arg += constants.size();
+	    break;
+	case Code::LoadVar:
+	    in.arg = lastDef[in.arg];
+	    if (in.arg != 0)
+	    {
+		deps.push_back(in.arg - 1);
+	    }
+	    break;
+	case Code::Store:
+	    targets.push_back(in.arg);
+	    lastDef[in.arg] = self;
+	    in.arg = self;
+	    break;
+	default:
+	    break;
+	}
+	code.push_back(in);
+    }
+    std::sort(deps.begin() + first, deps.end());
+    deps.erase(std::unique(deps.begin() + first, deps.end()), deps.end());
+    depEnds.push_back(deps.size());
+    constants.insert(constants.end(), c.constants.begin(), c.constants.end());
+    maxStack = std::max(maxStack, c.stack.size());
+    maxTemps = std::max(maxTemps, c.temps.size());
+    logEnds.push_back(log.size());
+}
+
+void Program::Run(unsigned threads)
+{
+    size_t n = starts.size();
+    results.assign(n + 1, 0.0);
+
+    // Invert the dependencies, so that finishing a statement can release the ones that read it.
+    if (userStarts.size() != n + 1)
+    {
+	userStarts.assign(n + 1, 0);
+	for (uint32_t d : deps)
+	{
+	    userStarts[d + 1]++;
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+	    userStarts[i + 1] += userStarts[i];
+	}
+	users.resize(deps.size());
+	std::vector<uint32_t> fill(userStarts.begin(), userStarts.end() - 1);
+	for (uint32_t i = 0, k = 0; i < n; i++)
+	{
+	    for (; k < depEnds[i]; k++)
+	    {
+		users[fill[deps[k]]++] = i;
+	    }
+	}
+	pending.reset(new std::atomic<uint32_t>[n]);
+    }
+    // More threads than statements would only wait for the last ones.
+    threads = std::max<size_t>(1, std::min<size_t>(threads, n));
+    workers.reset(new Worker[threads]);
+    for (uint32_t i = 0; i < n; i++)
+    {
+	uint32_t count = depEnds[i] - (i ? depEnds[i - 1] : 0);
+	pending[i].store(count, std::memory_order_relaxed);
+	if (count == 0)
+	{
+	    workers[uint64_t(i) * threads / n].ready.push_back(i);
+	}
+    }
+    left.store(n);
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++)
+    {
+	pool.emplace_back(&Program::Work, this, t, threads);
+    }
+    Work(0, threads);
+    for (std::thread& t : pool)
+    {
+	t.join();
+    }
+}
+
+// Take a ready statement, from the front of our own queue or else from the back of another thread's. The
+// queues start out with a contiguous run of the script each, so a thread walks through memory in order.
+bool Program::Next(unsigned self, unsigned threads, uint32_t& s)
+{
+    for (unsigned k = 0; k < threads; k++)
+    {
+	Worker&                     w = workers[(self + k) % threads];
+	std::lock_guard<std::mutex> guard(w.lock);
+	if (!w.ready.empty())
+	{
+	    if (k == 0)
+	    {
+		s = w.ready.front();
+		w.ready.pop_front();
+	    }
+	    else
+	    {
+		s = w.ready.back();
+		w.ready.pop_back();
+	    }
+	    return true;
+	}
+    }
+    return false;
+}
+
+// Run statement s on the results so far, with stack and temps big enough for any statement.
+double Program::Exec(uint32_t s, double* stack, double* temps) const
+{
+    return Code::Exec(&code[starts[s]], constants.data(), results.data(), stack, temps);
+}
+
+// Run statements until all are done. The first statement that finishing one makes ready runs next on the
+// same thread, without going through the queue; others are queued for whoever gets to them first.
+void Program::Work(unsigned self, unsigned threads)
+{
+    const uint32_t      None = UINT32_MAX;
+    std::vector<double> stack(maxStack);
+    std::vector<double> temps(maxTemps);
+    uint32_t            s = None;
+    unsigned            idle = 0;
+    while (s != None || left.load(std::memory_order_acquire) > 0)
+    {
+	if (s == None && !Next(self, threads, s))
+	{
+	    Backoff(++idle);
+	    continue;
+	}
+	idle = 0;
+	results[s + 1] = Exec(s, stack.data(), temps.data());
+	uint32_t next = None;
+	for (uint32_t k = userStarts[s]; k < userStarts[s + 1]; k++)
+	{
+	    uint32_t u = users[k];
+	    if (pending[u].fetch_sub(1, std::memory_order_acq_rel) != 1)
+	    {
+		continue;
+	    }
+	    if (next == None)
+	    {
+		next = u;
+		continue;
+	    }
+	    std::lock_guard<std::mutex> guard(workers[self].lock);
+	    workers[self].ready.push_front(u);
+	}
+	left.fetch_sub(1, std::memory_order_acq_rel);
+	s = next;
+    }
+}
+
+// Replace the last assignment of c's target with c, or add c at the end if the script never assigns it.
+// The new expression sees each variable as it was at that point of the script, so the results are those
+// of running the edited script from the start.
+void Program::Redefine(const Code& c)
+{
+    if (defs.empty())
+    {
+	defs.resize(symbols.values.size());
+	for (uint32_t i = 0; i < targets.size(); i++)
+	{
+	    defs[targets[i]].push_back(i);
+	}
+    }
+    defs.resize(symbols.values.size());
+    lastDef.resize(symbols.values.size(), 0);
+    queued.resize(starts.size(), 0);
+
+    uint32_t slot = c.code.back().arg;
+    if (lastDef[slot] == 0)
+    {
+	Add(c);
+	symbols.defined[slot] = true;
+	uint32_t s = starts.size() - 1;
+	for (uint32_t k = s ? depEnds[s - 1] : 0; k < depEnds[s]; k++)
+	{
+	    extraUsers.emplace(deps[k], s);
+	}
+	defs[slot].push_back(s);
+	results.push_back(0.0);
+	queued.push_back(0);
+	Queue(s, Added);
+	return;
+    }
+
+    uint32_t              s = lastDef[slot] - 1;
+    std::vector<uint32_t> early;
+    starts[s] = code.size();
+    for (Code::Instr in : c.code)
+    {
+	switch (in.op)
+	{
+	case Code::PushConst:
+	    in.arg += constants.size();
+	    break;
+	case Code::LoadVar:
+	{
+	    const std::vector<uint32_t>& d = defs[in.arg];
+	    auto                         it = std::lower_bound(d.begin(), d.end(), s);
+	    if (it == d.begin())
+	    {
+		// Once per statement, as Code::Report() does for variables that are never assigned.
+		if (symbols.defined[in.arg] && std::find(early.begin(), early.end(), in.arg) == early.end())
+		{
+		    early.push_back(in.arg);
+		    out << "Invalid variable " << symbols.Name(in.arg) << '\n';
+		}
+		in.arg = 0;
+		break;
+	    }
+	    --it;
+	    extraUsers.emplace(*it, s);
+	    in.arg = *it + 1;
+	    break;
+	}
+	case Code::Store:
+	    in.arg = s + 1;
+	    break;
+	default:
+	    break;
+	}
+	code.push_back(in);
+    }
+    constants.insert(constants.end(), c.constants.begin(), c.constants.end());
+    maxStack = std::max(maxStack, c.stack.size());
+    maxTemps = std::max(maxTemps, c.temps.size());
+    Queue(s, Queued);
+}
+
+void Program::Queue(uint32_t s, uint8_t how)
+{
+    if (!queued[s])
+    {
+	heap.push_back(s);
+	std::push_heap(heap.begin(), heap.end(), std::greater<>());
+    }
+    queued[s] |= how;
+}
+
+// Recompute the redefined statements and, transitively, every statement that reads one whose value
+// changed, printing each variable whose final value changed. Statements are taken in script order, so
+// each one's inputs are final by the time it runs. A statement added at the end is always printed.
+void Program::Update()
+{
+    std::vector<double> stack(maxStack);
+    std::vector<double> temps(maxTemps);
+    while (!heap.empty())
+    {
+	std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+	uint32_t s = heap.back();
+	heap.pop_back();
+	bool   added = queued[s] & Added;
+	double value = Exec(s, stack.data(), temps.data());
+	queued[s] = 0;
+	if (!added && memcmp(&value, &results[s + 1], sizeof(value)) == 0)
+	{
+	    continue;
+	}
+	results[s + 1] = value;
+	// An assignment the script overwrites later only matters to the statements in between.
+	if (lastDef[targets[s]] == s + 1)
+	{
+	    out << symbols.Name(targets[s]) << "=" << value << '\n';
+	}
+	if (s + 1 < userStarts.size())
+	{
+	    for (uint32_t k = userStarts[s]; k < userStarts[s + 1]; k++)
+	    {
+		Queue(users[k], Queued);
+	    }
+	}
+	for (auto [it, end] = extraUsers.equal_range(s); it != end; ++it)
+	{
+	    Queue(it->second, Queued);
+	}
+    }
+}
+
+// Print the value of the variable name as the whole script leaves it, as name=value, evaluating what it
+// needs that earlier queries haven't. What the parser printed for a statement goes out when it is
+// evaluated.
+void Program::Query(std::string_view name)
+{
+    uint32_t slot = symbols.Lookup(name);
+    if (slot == SymbolTable::NoSlot || slot >= lastDef.size() || lastDef[slot] == 0)
+    {
+	out << "Invalid variable " << name << '\n';
+	return;
+    }
+    Force(lastDef[slot] - 1);
+    out << name << "=" << results[lastDef[slot]] << '\n';
+}
+
+// Evaluate statement s after the statements it reads, depth first with an explicit stack.
+void Program::Force(uint32_t s)
+{
+    size_t n = starts.size();
+    if (done.size() != n)
+    {
+	done.assign(n, false);
+	results.assign(n + 1, 0.0);
+    }
+    std::vector<double> stack(maxStack);
+    std::vector<double> temps(maxTemps);
+    pendingWork.assign(1, s);
+    while (!pendingWork.empty())
+    {
+	uint32_t t = pendingWork.back();
+	if (done[t])
+	{
+	    pendingWork.pop_back();
+	    continue;
+	}
+	bool ready = true;
+	for (uint32_t k = t ? depEnds[t - 1] : 0; k < depEnds[t]; k++)
+	{
+	    if (!done[deps[k]])
+	    {
+		pendingWork.push_back(deps[k]);
+		ready = false;
+	    }
+	}
+	if (!ready)
+	{
+	    continue;
+	}
+	size_t from = t ? logEnds[t - 1] : 0;
+	out << std::string_view(log.data() + from, logEnds[t] - from);
+	results[t + 1] = Exec(t, stack.data(), temps.data());
+	done[t] = true;
+	pendingWork.pop_back();
+    }
+}
+
+void Program::Print() const
+{
+    size_t from = 0;
+    for (size_t i = 0; i < starts.size(); i++)
+    {
+	out << std::string_view(log.data() + from, logEnds[i] - from);
+	out << "val=" << results[i + 1] << '\n';
+	from = logEnds[i];
+    }
+    out << std::string_view(log.data() + from, log.size() - from);
+    out.Flush();
+}
+
+Jit::~Jit()
+{
+    Unmap();
+}
+
+void Jit::Disp(int32_t d)
+{
+    for (int i = 0; i < 4; i++)
+    {
+	Byte(uint32_t(d) >> (8 * i));
+    }
+}
+
+// An SSE instruction with a register operand: prefix [REX] 0F opcode ModRM.
+void Jit::SseReg(uint8_t prefix, uint8_t opcode, int reg, int rm)
+{
+    Byte(prefix);
+    if (reg >= 8 || rm >= 8)
+    {
+	Byte(0x40 | (reg >= 8) << 2 | (rm >= 8));
+    }
+    Byte(0x0f);
+    Byte(opcode);
+    Byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// An SSE instruction with a [base + disp32] memory operand, base being rdi or rsi.
+void Jit::SseMem(uint8_t prefix, uint8_t opcode, int reg, int base, int32_t disp)
+{
+    Byte(prefix);
+    if (reg >= 8)
+    {
+	Byte(0x44);
+    }
+    Byte(0x0f);
+    Byte(opcode);
+    Byte(0x80 | (reg & 7) << 3 | base);
+    Disp(disp);
+}
+
+void Jit::MovRaxImm(uint64_t imm)
+{
+    Byte(0x48);
+    Byte(0xb8);
+    for (int i = 0; i < 8; i++)
+    {
+	Byte(imm >> (8 * i));
+    }
+}
+
+void Jit::MovXmmRax(int xmm)
+{
+    Byte(0x66);
+    Byte(0x48 | (xmm >= 8) << 2);
+    Byte(0x0f);
+    Byte(0x6e);
+    Byte(0xc0 | (xmm & 7) << 3);
+}
+
+void Jit::MovRaxMem(int base, int32_t disp)
+{
+    Byte(0x48);
+    Byte(0x8b);
+    Byte(0x80 | base);
+    Disp(disp);
+}
+
+void Jit::MovMemRax(int base, int32_t disp)
+{
+    Byte(0x48);
+    Byte(0x89);
+    Byte(0x80 | base);
+    Disp(disp);
+}
+
+bool Jit::Compile(const Code& c)
+{
+#if defined(__x86_64__) && defined(__linux__)
+    // movsd load/store, and the arithmetic opcodes in bytecode order.
+    const uint8_t Load = 0x10, Store = 0x11, XorPd = 0x57;
+    const uint8_t arith[] = { 0x58, 0x5c, 0x59, 0x5e };
+    static_assert(Code::Sub == Code::Add + 1 && Code::Mul == Code::Add + 2 && Code::Div == Code::Add + 3);
+
+    buf.clear();
+    spills = c.stack.size() > Regs ? c.stack.size() - Regs : 0;
+    if ((spills + c.temps.size()) * 8 > INT32_MAX)
+    {
+	return false;
+    }
+    size_t depth = 0;
+    for (const Code::Instr& in : c.code)
+    {
+	switch (in.op)
+	{
+	case Code::PushConst:
+	case Code::LoadVar:
+	case Code::LoadTemp:
+	{
+	    if (in.op == Code::LoadVar && uint64_t(in.arg) * 8 > INT32_MAX)
+	    {
+		return false;
+	    }
+	    int     base = in.op == Code::LoadVar ? Rdi : Rsi;
+	    int32_t disp = in.op == Code::LoadVar ? in.arg * 8 : TempOffset(in.arg);
+	    if (in.op != Code::PushConst && depth < Regs)
+	    {
+		SseMem(0xf2, Load, depth, base, disp);
+		depth++;
+		break;
+	    }
+	    if (in.op != Code::PushConst)
+	    {
+		MovRaxMem(base, disp);
+	    }
+	    else
+	    {
+		uint64_t bits;
+		memcpy(&bits, &c.constants[in.arg], sizeof(bits));
+		MovRaxImm(bits);
+	    }
+	    if (depth < Regs)
+	    {
+		MovXmmRax(depth);
+	    }
+	    else
+	    {
+		MovMemRax(Rsi, SpillOffset(depth));
+	    }
+	    depth++;
+	    break;
+	}
+
+	case Code::Tee:
+	    if (depth - 1 < Regs)
+	    {
+		SseMem(0xf2, Store, depth - 1, Rsi, TempOffset(in.arg));
+	    }
+	    else
+	    {
+		MovRaxMem(Rsi, SpillOffset(depth - 1));
+		MovMemRax(Rsi, TempOffset(in.arg));
+	    }
+	    break;
+
+	case Code::Neg:
+	    if (depth - 1 < Regs)
+	    {
+		MovRaxImm(0x8000000000000000);
+		MovXmmRax(Scratch);
+		SseReg(0x66, XorPd, depth - 1, Scratch);
+	    }
+	    else
+	    {
+		// btc qword [rsi + disp32], 63
+		Byte(0x48);
+		Byte(0x0f);
+		Byte(0xba);
+		Byte(0x80 | 7 << 3 | Rsi);
+		Disp(SpillOffset(depth - 1));
+		Byte(63);
+	    }
+	    break;
+
+	case Code::Add:
+	case Code::Sub:
+	case Code::Mul:
+	case Code::Div:
+	{
+	    uint8_t op = arith[in.op - Code::Add];
+	    size_t  a = depth - 2, b = depth - 1;
+	    if (b < Regs)
+	    {
+		SseReg(0xf2, op, a, b);
+	    }
+	    else if (a < Regs)
+	    {
+		SseMem(0xf2, op, a, Rsi, SpillOffset(b));
+	    }
+	    else
+	    {
+		SseMem(0xf2, Load, Scratch, Rsi, SpillOffset(a));
+		SseMem(0xf2, op, Scratch, Rsi, SpillOffset(b));
+		SseMem(0xf2, Store, Scratch, Rsi, SpillOffset(a));
+	    }
+	    depth--;
+	    break;
+	}
+
+	case Code::Store:
+	    Byte(0xc3); // ret
+	    break;
+	}
+    }
+    spill.resize(spills + c.temps.size());
+    return Install();
+#else
+    return false;
+#endif
+}
+
+// Copy the code into the JIT memory. That is a memfd mapped twice, writable at one address and executable
+// at another, so no page is ever both and there are no mprotect() calls on the way to running the code.
+bool Jit::Install()
+{
+    if (memSize < buf.size())
+    {
+	Unmap();
+	size_t size = std::max<size_t>(64 * 1024, buf.size() * 2);
+	int    fd = memfd_create("constparser-jit", MFD_CLOEXEC);
+	if (fd < 0)
+	{
+	    return false;
+	}
+	if (ftruncate(fd, size) == 0)
+	{
+	    writable = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	    executable = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	memSize = size;
+	if (writable == MAP_FAILED || executable == MAP_FAILED)
+	{
+	    Unmap();
+	    return false;
+	}
+    }
+    memcpy(writable, buf.data(), buf.size());
+    fn = reinterpret_cast<double (*)(const double*, double*)>(executable);
+    return true;
+}
+
+void Jit::Unmap()
+{
+    for (void* m : { writable, executable })
+    {
+	if (m != MAP_FAILED)
+	{
+	    munmap(m, memSize);
+	}
+    }
+    writable = executable = MAP_FAILED;
+    memSize = 0;
+}
+
+unsigned Token::Precedence()
+{
+    switch (type)
+    {
+    case Token::Mult:
+    case Token::Divide:
+	return 2;
+    case Token::Plus:
+    case Token::Minus:
+	return 1;
+    default:
+	return 0;
+    }
+}
+
+Input::~Input()
+{
+    Close();
+}
+
+// Let go of the file, so that the Input can Map() another.
+void Input::Close()
+{
+    if (mapped)
+    {
+	munmap(mapped, mappedSize);
+	mapped = nullptr;
+    }
+    if (ownFd)
+    {
+	close(fd);
+	ownFd = false;
+    }
+    cur = end = mark = nullptr;
+    eof = false;
+}
+
+bool Input::Map(const char* path)
+{
+    Close();
+    int f = open(path, O_RDONLY);
+    if (f < 0)
+    {
+	out.Flush();
+	perror(path);
+	return false;
+    }
+    struct stat st;
+    if (fstat(f, &st) < 0)
+    {
+	out.Flush();
+	perror(path);
+	close(f);
+	return false;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+	// Pipes and devices can't be mapped, so read those in blocks like standard input.
+	fd = f;
+	ownFd = true;
+	return true;
+    }
+    eof = true;
+    mappedSize = st.st_size;
+    if (mappedSize != 0)
+    {
+	mapped = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, f, 0);
+	if (mapped == MAP_FAILED)
+	{
+	    out.Flush();
+	    perror(path);
+	    mapped = nullptr;
+	    close(f);
+	    return false;
+	}
+	madvise(mapped, mappedSize, MADV_SEQUENTIAL);
+	cur = static_cast<const char*>(mapped);
+	end = cur + mappedSize;
+    }
+    close(f);
+    return true;
+}
+
+void Input::Set(std::string_view text)
+{
+    Close();
+    eof = true;
+    cur = mark = text.data();
+    end = cur + text.size();
+}
+
+void Input::Release()
+{
+    mark = cur;
+    if (!retired.empty())
+    {
+	spare = std::move(retired.back());
+	retired.clear();
+    }
+}
+
+bool Input::Refill()
+{
+    if (eof)
+    {
+	return false;
+    }
+    size_t keep = mark ? end - mark : 0;
+    if (keep != 0 || buf.empty())
+    {
+	// Text from mark onwards is still referenced, so move to another block instead of reading over it.
+	size_t size = std::max(BlockSize, 2 * keep);
+	if (spare.size() < size)
+	{
+	    spare.resize(size);
+	}
+	std::copy(mark, end, spare.data());
+	if (!buf.empty())
+	{
+	    retired.push_back(std::move(buf));
+	}
+	buf = std::move(spare);
+	spare.clear();
+    }
+    mark = buf.data();
+    // Whoever is feeding us may be waiting on what we have printed so far.
+    out.Flush();
+    for (;;)
+    {
+	ssize_t n = read(fd, buf.data() + keep, buf.size() - keep);
+	if (n > 0)
+	{
+	    cur = buf.data() + keep;
+	    end = cur + n;
+	    return true;
+	}
+	if (n < 0 && errno == EINTR)
+	{
+	    continue;
+	}
+	if (n < 0)
+	{
+	    out.Flush();
+	    perror("read");
+	}
+	eof = true;
+	cur = end = buf.data() + keep;
+	return false;
+    }
+}
+
+// Character classes for the lexer. Classifying through this table rather than <cctype> avoids the locale
+// machinery, and it matches the "C" locale the lexer has always assumed.
+enum CharClass : uint8_t
+{
+    Space = 1,
+    Alpha = 2,
+    Digit = 4,
+    Hex = 8,
+    AlNum = Alpha | Digit,
+};
+
+constexpr std::array<uint8_t, 256> MakeCharClasses()
+{
+    std::array<uint8_t, 256> t{};
+    for (int c = 0; c < 256; c++)
+    {
+	if (c == ' ' || (c >= '\t' && c <= '\r'))
+	    t[c] = Space;
+	else if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'))
+	    t[c] = Alpha | Hex;
+	else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+	    t[c] = Alpha;
+	else if (c >= '0' && c <= '9')
+	    t[c] = Digit | Hex;
+    }
+    return t;
+}
+
+constexpr std::array<uint8_t, 256> charClasses = MakeCharClasses();
+
+inline bool IsClass(int ch, uint8_t cls)
+{
+    return charClasses[ch] & cls;
+}
+
+// Scanners return the first position in [p, end) whose character is not in class Cls.
+template<uint8_t Cls>
+const char* ScanScalar(const char* p, const char* end)
+{
+    while (p != end && IsClass(static_cast<unsigned char>(*p), Cls))
+    {
+	p++;
+    }
+    return p;
+}
+
+#if CP_SIMD
+// The vector scanners test each class as one or two unsigned range checks: there is no unsigned byte
+// compare, so the range [lo, lo + count) is shifted down to start at -128 and compared signed.
+inline __m128i InRange(__m128i v, char lo, char count)
+{
+    return _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8(char(-128 - lo))), _mm_set1_epi8(char(-128 + count)));
+}
+
+template<uint8_t Cls>
+inline __m128i ClassMask(__m128i v)
+{
+    __m128i m = _mm_setzero_si128();
+    if (Cls & Space)
+    {
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+	m = _mm_or_si128(m, InRange(v, '\t', 5));
+    }
+    if (Cls & Alpha)
+    {
+	m = _mm_or_si128(m, InRange(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 26));
+    }
+    if (Cls & Digit)
+    {
+	m = _mm_or_si128(m, InRange(v, '0', 10));
+    }
+    return m;
+}
+
+template<uint8_t Cls>
+const char* ScanSSE2(const char* p, const char* end)
+{
+    while (end - p >= 16)
+    {
+	unsigned m = _mm_movemask_epi8(ClassMask<Cls>(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+	if (m != 0xffff)
+	{
+	    return p + __builtin_ctz(~m);
+	}
+	p += 16;
+    }
+    return ScanScalar<Cls>(p, end);
+}
+
+__attribute__((target("avx2"))) inline __m256i InRange(__m256i v, char lo, char count)
+{
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8(char(-128 + count)),
+			     _mm256_add_epi8(v, _mm256_set1_epi8(char(-128 - lo))));
+}
+
+template<uint8_t Cls>
+__attribute__((target("avx2"))) inline __m256i ClassMask(__m256i v)
+{
+    __m256i m = _mm256_setzero_si256();
+    if (Cls & Space)
+    {
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+	m = _mm256_or_si256(m, InRange(v, '\t', 5));
+    }
+    if (Cls & Alpha)
+    {
+	m = _mm256_or_si256(m, InRange(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 26));
+    }
+    if (Cls & Digit)
+    {
+	m = _mm256_or_si256(m, InRange(v, '0', 10));
+    }
+    return m;
+}
+
+template<uint8_t Cls>
+__attribute__((target("avx2"))) const char* ScanAVX2(const char* p, const char* end)
+{
+    while (end - p >= 32)
+    {
+	unsigned m = _mm256_movemask_epi8(
+	    ClassMask<Cls>(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))));
+	if (m != 0xffffffff)
+	{
+	    return p + __builtin_ctz(~m);
+	}
+	p += 32;
+    }
+    return ScanSSE2<Cls>(p, end);
+}
+#endif
+
+struct Scanners
+{
+    using Fn = const char* (*)(const char*, const char*);
+    Fn space;
+    Fn alnum;
+    Fn digit;
+};
+
+Scanners SelectScanners()
+{
+#if CP_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+	return { ScanAVX2<Space>, ScanAVX2<AlNum>, ScanAVX2<Digit> };
+    }
+    return { ScanSSE2<Space>, ScanSSE2<AlNum>, ScanSSE2<Digit> };
+#else
+    return { ScanScalar<Space>, ScanScalar<AlNum>, ScanScalar<Digit> };
+#endif
+}
+
+const Scanners scan = SelectScanners();
+
+void Backoff(unsigned n)
+{
+    if (n < 64)
+    {
+	return;
+    }
+    if (n < 256)
+    {
+	std::this_thread::yield();
+	return;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+Session::Session(int in, int outFd, const Options& o)
+    : options(o), out(outFd), ast(options, symbols, out), code(symbols, out), program(symbols, out),
+      input(in, out)
+{
+    out.exact = options.exact;
+    out.capture = options.embedded;
+}
+
+void Session::Load(std::string_view text)
+{
+    input.Set(text);
+    curValid = false;
+    results.clear();
+    unparsed = 0;
+}
+
+std::string Session::Messages()
+{
+    messages += out.Take();
+    return std::move(messages);
+}
+
+// Make more input available after p, where [start, p) is the token scanned so far. The token is carried
+// over if the input moves on to a new block, so both pointers are updated. Returns false at end of input.
+bool Session::More(const char*& start, const char*& p)
+{
+    size_t offset = start - input.mark;
+    size_t length = p - start;
+    bool   more = input.Refill();
+    start = input.mark + offset;
+    p = start + length;
+    return more;
+}
+
+// Skip the characters from p onwards that scanner accepts, refilling the input as needed.
+void Session::Skip(const char*& start, const char*& p, Scanner scanner)
+{
+    for (;;)
+    {
+	p = scanner(p, input.end);
+	if (p != input.end || !More(start, p))
+	{
+	    return;
+	}
+    }
+}
+
+// Return the character k positions after p, or -1 if the input ends before that.
+int Session::At(const char*& start, const char*& p, ptrdiff_t k)
+{
+    while (input.end - p <= k)
+    {
+	if (!More(start, p))
+	{
+	    return -1;
+	}
+    }
+    return static_cast<unsigned char>(p[k]);
+}
+
+// Return the run of characters starting at start (already consumed) that are in the class scan accepts.
+// The run is always contiguous in the buffer.
+std::string_view Session::ScanRun(const char* start, Scanner scanner)
+{
+    const char* p = input.cur;
+    Skip(start, p, scanner);
+    input.cur = p;
+    return std::string_view(start, p - start);
+}
+
+// Return the number starting at start (already consumed, a digit or '.'): either a hex literal 0x1f, or
+// decimal digits with an optional fraction and exponent, as in 12, 1.5, .5, 1. and 1e-9. A '.' that
+// isn't followed by a digit is returned on its own.
+std::string_view Session::ScanNumber(const char* start)
+{
+    const char* p = input.cur;
+    auto        isClass = [](int ch, uint8_t cls) { return ch >= 0 && IsClass(ch, cls); };
+    if (*start == '0' && (At(start, p, 0) | 0x20) == 'x' && isClass(At(start, p, 1), Hex))
+    {
+	p++;
+	Skip(start, p, ScanScalar<Hex>);
+    }
+    else if (*start != '.' || isClass(At(start, p, 0), Digit))
+    {
+	Skip(start, p, scan.digit);
+	if (*start != '.' && At(start, p, 0) == '.')
+	{
+	    p++;
+	    Skip(start, p, scan.digit);
+	}
+	if ((At(start, p, 0) | 0x20) == 'e')
+	{
+	    int sign = At(start, p, 1);
+	    int k = (sign == '+' || sign == '-') ? 2 : 1;
+	    if (isClass(At(start, p, k), Digit))
+	    {
+		p += k;
+		Skip(start, p, scan.digit);
+	    }
+	}
+    }
+    input.cur = p;
+    return std::string_view(start, p - start);
+}
+
+Token Session::GetNextToken()
+{
+    for (;;)
+    {
+	input.cur = scan.space(input.cur, input.end);
+	if (input.cur == input.end)
+	{
+	    if (!input.Refill())
+	    {
+		return Token::EndOfFile;
+	    }
+	    continue;
+	}
+	const char* start = input.cur;
+	int         ch = static_cast<unsigned char>(*input.cur++);
+	if (IsClass(ch, Alpha))
+	{
+	    return Token(ScanRun(start, scan.alnum), Token::Varname);
+	}
+	if (IsClass(ch, Digit) || ch == '.')
+	{
+	    std::string_view v = ScanNumber(start);
+	    if (v != ".")
+	    {
+		return Token(v, Token::Number);
+	    }
+	}
+	switch (ch)
+	{
+	case '+':
+	    return Token(Token::Plus);
+	case '-':
+	    return Token(Token::Minus);
+	case '*':
+	    return Token(Token::Mult);
+	case '/':
+	    return Token(Token::Divide);
+	case '=':
+	    return Token(Token::Equal);
+	case '(':
+	    return Token(Token::LParen);
+	case ')':
+	    return Token(Token::RParen);
+	case ';':
+	    return Token(Token::SemiColon);
+	default:
+	    out << "Uh? found character '" << ch << "' which doesn't seem to be useful here"
+		      << '\n';
+	    break;
+	}
+    }
+}
+
+Token Session::GetToken()
+{
+    if (!curValid)
+    {
+	curToken = pipeline ? Receive() : GetNextToken();
+	curValid = true;
+    }
+    return curToken;
+}
+
+void Session::NextToken()
+{
+    curValid = false;
+}
+
+double Session::ToDouble(std::string_view val)
+{
+    const char*       first = val.data();
+    const char*       last = first + val.size();
+    std::chars_format fmt = std::chars_format::general;
+    if (val.size() > 2 && val[0] == '0' && (val[1] | 0x20) == 'x')
+    {
+	first += 2;
+	fmt = std::chars_format::hex;
+    }
+    double d;
+    auto [ptr, ec] = std::from_chars(first, last, d, fmt);
+    if (ec == std::errc() && ptr == last)
+    {
+	return d;
+    }
+    out << "Invalid number, replacing with -1" << '\n';
+    return -1.0;
+}
+
+bool Session::Expect(Token::Type ty, Token& t)
+{
+    t = GetToken();
+    NextToken();
+    if (t.type != ty && t.type != Token::EndOfFile)
+    {
+	out << "Invalid token, expected: " << Token(ty) << " got " << t << '\n';
+	return false;
+    }
+    return true;
+}
+
+// Parse an expression up to the ';' that ends it. The parser keeps the operands and the operators waiting
+// for them on stacks of its own rather than recursing, so expressions can nest as deeply as memory allows.
+// An operator is applied once everything of higher precedence to its right has been, a sign applies to the
+// operand right after it, and a parenthesized expression is an operand. A token that is out of place is
+// reported and skipped, along with the operand after it; the end of the input makes the whole expression
+// -1.
+NodeId Session::ParseExpr()
+{
+    operands.clear();
+    operators.clear();
+    size_t groups = 0;
+    bool   operand = true;
+    for (;;)
+    {
+	Token t = GetToken();
+	if (operand)
+	{
+	    switch (t.type)
+	    {
+	    case Token::Plus:
+	    case Token::Minus:
+		NextToken();
+		operators.push_back({ Pending::Sign, t });
+		continue;
+
+	    case Token::LParen:
+		NextToken();
+		operators.push_back({ Pending::Group, t });
+		groups++;
+		continue;
+
+	    case Token::Number:
+		NextToken();
+		operands.push_back(ast.MakeConstant(ToDouble(t.value)));
+		break;
+
+	    case Token::Varname:
+		NextToken();
+		operands.push_back(ast.MakeVariable(symbols.Intern(t.value)));
+		break;
+
+	    case Token::EndOfFile:
+	    case Token::SemiColon:
+		operands.push_back(ast.MakeConstant(0.0));
+		break;
+
+	    default:
+		out << "Unknown value" << '\n';
+		operands.push_back(ast.MakeConstant(0.0));
+		break;
+	    }
+	    operand = false;
+	    if (!Complete())
+	    {
+		return ast.MakeConstant(-1);
+	    }
+	    continue;
+	}
+
+	unsigned prec = t.Precedence();
+	if (prec != 0)
+	{
+	    NextToken();
+	    Reduce(prec);
+	    operators.push_back({ Pending::Binary, t });
+	    operand = true;
+	    continue;
+	}
+	if (groups != 0 &&
+	    (t.type == Token::RParen || t.type == Token::SemiColon || t.type == Token::EndOfFile))
+	{
+	    if (t.type == Token::RParen)
+	    {
+		NextToken();
+	    }
+	    else
+	    {
+		out << "Error: Missing ')'" << '\n';
+	    }
+	    Reduce(1);
+	    operators.pop_back();
+	    groups--;
+	    if (!Complete())
+	    {
+		return ast.MakeConstant(-1);
+	    }
+	    continue;
+	}
+	Reduce(1);
+	if (t.type == Token::SemiColon)
+	{
+	    return operands.back();
+	}
+	NextToken();
+	operators.push_back({ Pending::Stray, t });
+	operand = true;
+    }
+}
+
+// The operand on top of the stack is complete. Apply the signs before it, and see what it was for: with -v
+// the operator it is the right operand of is reported now, and an operand after a token that is out of
+// place is dropped. Returns false if that token was the end of the input.
+bool Session::Complete()
+{
+    while (!operators.empty() && operators.back().kind == Pending::Sign)
+    {
+	operands.back() = ast.MakeUnary(operators.back().token.type, operands.back());
+	operators.pop_back();
+    }
+    if (operators.empty() || operators.back().kind == Pending::Group)
+    {
+	return true;
+    }
+    Pending p = operators.back();
+    if (options.verbose)
+    {
+	out << "Token: " << p.token << '\n';
+    }
+    if (p.kind == Pending::Binary)
+    {
+	return true;
+    }
+    operators.pop_back();
+    operands.pop_back();
+    switch (p.token.type)
+    {
+    case Token::EndOfFile:
+	return false;
+
+    case Token::Equal:
+	out << "Error: Unexpected '='" << '\n';
+	NextToken();
+	return true;
+
+    default:
+	out << "Error, unknown token" << '\n';
+	NextToken();
+	return true;
+    }
+}
+
+// Apply the binary operators on top of the stack whose precedence is at least prec.
+void Session::Reduce(unsigned prec)
+{
+    while (!operators.empty() && operators.back().kind == Pending::Binary &&
+	   operators.back().token.Precedence() >= prec)
+    {
+	NodeId rhs = operands.back();
+	operands.pop_back();
+	operands.back() = ast.MakeBinary(operators.back().token.type, operands.back(), rhs);
+	operators.pop_back();
+    }
+}
+
+// Evaluate the expression at root and assign it to target, returning the value. With -n the evaluation is
+// repeated and timed.
+double Session::Evaluate(NodeId root, uint32_t target, uint64_t& ops, std::chrono::duration<double>& time)
+{
+    auto   start = std::chrono::steady_clock::now();
+    double result = 0;
+    if (options.engine != Engine::Ast)
+    {
+	code.Compile(ast, root, target);
+	result = Execute(ops);
+    }
+    else
+    {
+	for (unsigned i = 0; i < options.repeat; i++)
+	{
+	    result = ast.Evaluate(root);
+	    symbols.Assign(target, result);
+	}
+	ops += uint64_t(root + 1) * options.repeat;
+	if (options.verbose)
+	{
+	    ast.PrintEvaluations(root);
+	}
+    }
+    time += std::chrono::steady_clock::now() - start;
+    return result;
+}
+
+// Run the statement in code options.repeat times with the engine asked for, and return its value.
+double Session::Execute(uint64_t& ops)
+{
+    uint32_t target = code.code.back().arg;
+    bool     native = options.engine == Engine::Jit && jit.Compile(code);
+    double   result = 0;
+    for (unsigned i = 0; i < options.repeat; i++)
+    {
+	if (native)
+	{
+	    result = jit.Run(symbols.values.data());
+	    symbols.Assign(target, result);
+	}
+	else
+	{
+	    result = code.Run();
+	}
+    }
+    ops += uint64_t(code.Ops()) * options.repeat;
+    return result;
+}
+
+// With -p, parse and compile the whole script before evaluating any of it. What the parser prints is then
+// captured rather than written, to go out along with the statement it belongs to.
+void Session::Parse()
+{
+    uint64_t                      ops = 0;
+    std::chrono::duration<double> time{};
+    if (options.parallel)
+    {
+	out.Flush();
+	out.capture = true;
+    }
+    if (options.split && options.parallel && options.threads > 1 && input.InMemory())
+    {
+	ParseSplit(ops, time);
+    }
+    else if (options.pipelined && !options.parallel && !options.embedded && options.engine != Engine::Ast)
+    {
+	ParsePipelined(ops, time);
+    }
+    else
+    {
+	ParseStatements(ops, time);
+    }
+    if (options.parallel && !options.queries.empty())
+    {
+	out.capture = false;
+	for (const char* q : options.queries)
+	{
+	    program.Query(q);
+	}
+    }
+    else if (options.parallel)
+    {
+	program.Note(out.Take());
+	out.capture = false;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < options.repeat; i++)
+	{
+	    program.Run(options.threads);
+	}
+	time = std::chrono::steady_clock::now() - start;
+	ops = program.Ops() * options.repeat;
+	program.Print();
+    }
+    if (options.repeat > 1)
+    {
+	out.Flush();
+	std::cerr << "Evaluated " << ops << " ops in " << time.count() << " s: " << ops / time.count() / 1e6
+		  << " Mops/s" << std::endl;
+    }
+}
+
+// Parse statements up to the end of the input. Each one is evaluated and printed right away, or kept for
+// Results() when embedded, or compiled into the program for -p, or into chunk for a piece of a script.
+void Session::ParseStatements(uint64_t& ops, std::chrono::duration<double>& time)
+{
+    Token v;
+    do
+    {
+	input.Release();
+	if (pipeline)
+	{
+	    for (std::unique_ptr<Pipeline::Tokens>& b : held)
+	    {
+		pipeline->spareTokens.TryPush(b);
+	    }
+	    held.clear();
+	}
+	ast.Clear();
+	if (Expect(Token::Varname, v))
+	{
+	    if (v.type == Token::EndOfFile && chunk && !chunk->last)
+	    {
+		break;
+	    }
+	    if (v.type == Token::EndOfFile && options.embedded)
+	    {
+		break;
+	    }
+	    if (options.verbose)
+	    {
+		out << v << '\n';
+	    }
+	    if (options.embedded)
+	    {
+		messages += out.Take();
+	    }
+	    Token e;
+	    if (Expect(Token::Equal, e))
+	    {
+		NodeId val = ParseExpr();
+		if (chunk && GetToken().type == Token::EndOfFile)
+		{
+		    chunk->clean = false;
+		}
+		if (options.embedded && GetToken().type == Token::EndOfFile)
+		{
+		    out.Take();
+		    unparsed = input.end - v.value.data();
+		    break;
+		}
+		NextToken();
+		if (options.associative)
+		{
+		    val = ast.Reassociate(val);
+		}
+		uint32_t target = symbols.Intern(v.value);
+		if (chunk)
+		{
+		    Chunk& c = *chunk;
+		    code.Compile(ast, val, target);
+		    c.code.insert(c.code.end(), code.code.begin(), code.code.end());
+		    c.constants.insert(c.constants.end(), code.constants.begin(), code.constants.end());
+		    c.log += out.Take();
+		    for (; named < symbols.values.size(); named++)
+		    {
+			c.names.push_back(symbols.Name(named));
+		    }
+		    c.statements.push_back({ c.code.size(), c.constants.size(), c.log.size(), c.names.size(),
+					     uint32_t(code.stack.size()), uint32_t(code.temps.size()) });
+		    if (pipeline && c.statements.size() == 256)
+		    {
+			Send();
+		    }
+		    continue;
+		}
+		if (options.parallel)
+		{
+		    code.Compile(ast, val, target);
+		    symbols.defined[target] = true;
+		    program.Note(out.Take());
+		    program.Add(code);
+		    continue;
+		}
+		double result = Evaluate(val, target, ops, time);
+		if (options.embedded)
+		{
+		    results.push_back({ target, result });
+		    continue;
+		}
+		out << "val=" << result << '\n';
+	    }
+	}
+    } while (v.type != Token::EndOfFile);
+    if (chunk)
+    {
+	chunk->log += out.Take();
+    }
+}
+
+// For -P: split the script at ';' into a piece for each thread, parse the pieces at once in sessions of
+// their own, and then add their statements to the program in order, as parsing the whole script here would
+// have. Only then is it known which variables were read before being assigned, so that is checked here. A
+// ';' ends a statement unless it is skipped over after a syntax error, so the pieces nearly always end
+// between statements; from the first one that doesn't, the rest of the script is parsed here instead.
+void Session::ParseSplit(uint64_t& ops, std::chrono::duration<double>& time)
+{
+    std::vector<const char*> bounds{ input.cur };
+    size_t                   size = input.end - input.cur;
+    for (unsigned k = 1; size != 0 && k < options.threads; k++)
+    {
+	const char* p = std::max(bounds.back(), input.cur + size * k / options.threads);
+	const char* semi = static_cast<const char*>(memchr(p, ';', input.end - p));
+	if (!semi)
+	{
+	    break;
+	}
+	bounds.push_back(semi + 1);
+    }
+    bounds.push_back(input.end);
+
+    Options pieceOptions = options;
+    pieceOptions.parallel = false;
+    pieceOptions.split = false;
+    std::vector<std::unique_ptr<Session>> pieces;
+    for (size_t k = 0; k + 1 < bounds.size(); k++)
+    {
+	pieces.push_back(std::make_unique<Session>(-1, -1, pieceOptions));
+	Session& piece = *pieces.back();
+	piece.out.capture = true;
+	piece.code.check = false;
+	piece.chunk = std::make_unique<Chunk>();
+	piece.chunk->last = k + 2 == bounds.size();
+	piece.input.Set(std::string_view(bounds[k], bounds[k + 1] - bounds[k]));
+    }
+    std::vector<std::thread> threads;
+    for (size_t k = 1; k < pieces.size(); k++)
+    {
+	threads.emplace_back(
+	    [&piece = *pieces[k]]
+	    {
+		uint64_t                      ops = 0;
+		std::chrono::duration<double> time{};
+		piece.ParseStatements(ops, time);
+	    });
+    }
+    pieces[0]->ParseStatements(ops, time);
+    for (std::thread& t : threads)
+    {
+	t.join();
+    }
+
+    std::vector<uint32_t> slots;
+    for (size_t k = 0; k < pieces.size(); k++)
+    {
+	Session& piece = *pieces[k];
+	Chunk&   c = *piece.chunk;
+	if (!c.last && !c.clean)
+	{
+	    input.cur = input.mark = bounds[k];
+	    ParseStatements(ops, time);
+	    return;
+	}
+	slots.resize(piece.symbols.values.size());
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+	    slots[i] = symbols.Intern(piece.symbols.Name(i));
+	}
+	size_t codeStart = 0, constantStart = 0, logStart = 0;
+	for (const Chunk::Statement& s : c.statements)
+	{
+	    out << std::string_view(c.log).substr(logStart, s.logEnd - logStart);
+	    code.code.assign(c.code.begin() + codeStart, c.code.begin() + s.codeEnd);
+	    for (Code::Instr& in : code.code)
+	    {
+		if (in.op == Code::LoadVar || in.op == Code::Store)
+		{
+		    in.arg = slots[in.arg];
+		}
+	    }
+	    code.Report();
+	    symbols.defined[code.code.back().arg] = true;
+	    code.constants.assign(c.constants.begin() + constantStart, c.constants.begin() + s.constantEnd);
+	    code.stack.resize(s.stack);
+	    code.temps.resize(s.temps);
+	    program.Note(out.Take());
+	    program.Add(code);
+	    codeStart = s.codeEnd;
+	    constantStart = s.constantEnd;
+	    logStart = s.logEnd;
+	}
+	out << std::string_view(c.log).substr(logStart);
+	pieces[k].reset();
+    }
+}
+
+// For -s: lex on one thread and parse on another while the statements are run here as they come, so that
+// reading the input, parsing it and evaluating it overlap. The parser compiles each statement against its
+// own symbol table and sends the names it has interned along, which are interned here in the same order
+// to get the same slots. As with -P, variables read before being assigned are only reported here.
+void Session::ParsePipelined(uint64_t& ops, std::chrono::duration<double>& time)
+{
+    Pipeline pipe;
+    Session  lexer(input.InMemory() ? -1 : input.Fd(), -1, options);
+    Session  parser(-1, -1, options);
+    if (input.InMemory())
+    {
+	lexer.input.Set(std::string_view(input.cur, input.end - input.cur));
+    }
+    lexer.out.capture = true;
+    parser.out.capture = true;
+    parser.code.check = false;
+    parser.chunk = std::make_unique<Chunk>();
+    parser.chunk->last = true;
+    parser.pipeline = &pipe;
+    std::thread lexing([&] { lexer.LexInto(pipe); });
+    std::thread parsing(
+	[&]
+	{
+	    uint64_t                      ops = 0;
+	    std::chrono::duration<double> time{};
+	    parser.ParseStatements(ops, time);
+	    parser.Send();
+	    pipe.statements.Push(nullptr);
+	});
+
+    for (std::unique_ptr<Chunk> c;;)
+    {
+	if (!pipe.statements.TryPop(c))
+	{
+	    out.Flush();
+	    c = pipe.statements.Pop();
+	}
+	if (!c)
+	{
+	    break;
+	}
+	size_t codeStart = 0, constantStart = 0, logStart = 0, nameStart = 0;
+	for (const Chunk::Statement& s : c->statements)
+	{
+	    out << std::string_view(c->log).substr(logStart, s.logEnd - logStart);
+	    for (size_t i = nameStart; i < s.nameEnd; i++)
+	    {
+		symbols.Intern(c->names[i]);
+	    }
+	    code.code.assign(c->code.begin() + codeStart, c->code.begin() + s.codeEnd);
+	    code.Report();
+	    code.constants.assign(c->constants.begin() + constantStart, c->constants.begin() + s.constantEnd);
+	    code.stack.resize(s.stack);
+	    code.temps.resize(s.temps);
+	    auto   start = std::chrono::steady_clock::now();
+	    double result = Execute(ops);
+	    time += std::chrono::steady_clock::now() - start;
+	    out << "val=" << result << '\n';
+	    codeStart = s.codeEnd;
+	    constantStart = s.constantEnd;
+	    logStart = s.logEnd;
+	    nameStart = s.nameEnd;
+	}
+	out << std::string_view(c->log).substr(logStart);
+	c->code.clear();
+	c->constants.clear();
+	c->statements.clear();
+	c->log.clear();
+	c->names.clear();
+	pipe.spareStatements.TryPush(c);
+    }
+    lexing.join();
+    parsing.join();
+}
+
+// The lexer's side of -s: split the whole input into tokens, and send them to the parser in batches. A
+// batch goes as soon as there are no more tokens to read without waiting for input, so that the parser
+// isn't kept waiting along with it.
+void Session::LexInto(Pipeline& pipe)
+{
+    constexpr size_t                  BatchTokens = 4096;
+    constexpr size_t                  BatchText = 64 * 1024;
+    std::unique_ptr<Pipeline::Tokens> batch;
+    for (;;)
+    {
+	input.Release();
+	Token t = GetNextToken();
+	if (batch && batch->text.capacity() - batch->text.size() < t.value.size())
+	{
+	    pipe.tokens.Push(std::move(batch));
+	}
+	if (!batch)
+	{
+	    if (!pipe.spareTokens.TryPop(batch))
+	    {
+		batch = std::make_unique<Pipeline::Tokens>();
+	    }
+	    batch->tokens.clear();
+	    batch->logEnds.clear();
+	    batch->text.clear();
+	    batch->log.clear();
+	    batch->text.reserve(std::max(BatchText, t.value.size()));
+	}
+	// The text is copied into the batch, which has room for it, so the views into it stay valid.
+	const char* text = batch->text.data() + batch->text.size();
+	batch->text.append(t.value);
+	t.value = std::string_view(text, t.value.size());
+	batch->log += out.Take();
+	batch->tokens.push_back(t);
+	batch->logEnds.push_back(batch->log.size());
+	if (t.type == Token::EndOfFile)
+	{
+	    pipe.tokens.Push(std::move(batch));
+	    return;
+	}
+	input.cur = scan.space(input.cur, input.end);
+	if (batch->tokens.size() == BatchTokens || input.cur == input.end)
+	{
+	    pipe.tokens.Push(std::move(batch));
+	}
+    }
+}
+
+// The parser's side of -s: the next token from the lexer, once what the lexer reported before it has been
+// passed on. Batches are kept until the statement that uses them is done. While waiting for the lexer, the
+// statements parsed so far are sent on.
+Token Session::Receive()
+{
+    while (!received || receivedNext == received->tokens.size())
+    {
+	if (received)
+	{
+	    held.push_back(std::move(received));
+	}
+	if (!pipeline->tokens.TryPop(received))
+	{
+	    if (!chunk->statements.empty())
+	    {
+		Send();
+	    }
+	    received = pipeline->tokens.Pop();
+	}
+	receivedNext = 0;
+	receivedLog = 0;
+    }
+    Token  t = received->tokens[receivedNext];
+    size_t logEnd = received->logEnds[receivedNext];
+    out << std::string_view(received->log).substr(receivedLog, logEnd - receivedLog);
+    receivedLog = logEnd;
+    // Like GetNextToken(), keep returning the end of the input once it has been reached.
+    if (t.type != Token::EndOfFile)
+    {
+	receivedNext++;
+    }
+    return t;
+}
+
+// Send the statements parsed so far to be run, and start on a fresh batch.
+void Session::Send()
+{
+    pipeline->statements.Push(std::move(chunk));
+    if (!pipeline->spareStatements.TryPop(chunk))
+    {
+	chunk = std::make_unique<Chunk>();
+    }
+    chunk->last = true;
+}
+
+// Apply the assignments in path to the script Parse() left in program, each one replacing the variable's
+// last assignment, and print the values that change.
+bool Session::Patch(const char* path)
+{
+    if (!input.Map(path))
+    {
+	return false;
+    }
+    curValid = false;
+    Token v;
+    for (;;)
+    {
+	input.Release();
+	ast.Clear();
+	if (!Expect(Token::Varname, v))
+	{
+	    continue;
+	}
+	if (v.type == Token::EndOfFile)
+	{
+	    break;
+	}
+	Token e;
+	if (Expect(Token::Equal, e))
+	{
+	    NodeId val = ParseExpr();
+	    NextToken();
+	    if (options.associative)
+	    {
+		val = ast.Reassociate(val);
+	    }
+	    code.Compile(ast, val, symbols.Intern(v.value));
+	    program.Redefine(code);
 	}
     }
+    program.Update();
+    return true;
+}
 
-    Parse();
+void Session::Lex()
+{
+    size_t count = 0;
+    for (;;)
+    {
+	input.Release();
+	if (GetNextToken().type == Token::EndOfFile)
+	{
+	    break;
+	}
+	count++;
+    }
+    out << count << " tokens" << '\n';
 }
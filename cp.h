@@ -0,0 +1,657 @@
+// The parser and evaluators behind constparser and libconstparser. This is the C++ side; programs using
+// the library go through the C API in constparser.h.
+#pragma once
+
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Buffered output to a file descriptor. Text collects in a large buffer that is written out when it fills
+// up and at the explicit flush points: before the program waits for more input, before anything goes to
+// standard error, and at exit. Numbers are formatted with to_chars, by default the way iostreams print
+// them (%g with six significant digits), or with exact set as the shortest text that reads back as the
+// same double. While capture is set nothing is written, and Take() hands over what was collected.
+class Output
+{
+public:
+    Output(int f) : fd(f) {}
+    ~Output() { Flush(); }
+
+    Output& operator<<(std::string_view s);
+    Output& operator<<(char c);
+    Output& operator<<(double d);
+    template <class T, std::enable_if_t<std::is_integral_v<T>, int> = 0>
+    Output& operator<<(T n);
+
+    void        Flush();
+    std::string Take();
+
+    bool capture = false;
+    bool exact = false;
+
+private:
+    static constexpr size_t BufferSize = 64 * 1024;
+
+    int         fd;
+    std::string buf;
+};
+
+template <class T, std::enable_if_t<std::is_integral_v<T>, int>>
+Output& Output::operator<<(T n)
+{
+    char                 text[24];
+    std::to_chars_result r = std::to_chars(text, std::end(text), n);
+    return *this << std::string_view(text, r.ptr - text);
+}
+
+class Token
+{
+public:
+    enum Type
+    {
+	Varname,
+	Number,
+	Plus,
+	Minus,
+	Mult,
+	Divide,
+	LParen,
+	RParen,
+	Equal,
+	SemiColon,
+	EndOfFile,
+	Undefined
+    };
+    Type             type;
+    std::string_view value;
+    Token(std::string_view v, Type t) : type(t), value(v) {}
+    Token(Type t) : type(t) {}
+    Token() : type(Undefined) {}
+    unsigned    Precedence();
+    std::string ToString() const;
+};
+
+enum class Engine
+{
+    Ast,
+    Vm,
+    Jit
+};
+
+// What the command line asks for. A Session keeps its own copy. The C API runs sessions embedded: each
+// statement's value is kept for the caller rather than printed, messages are kept for it too, and the end
+// of the input simply ends the script.
+struct Options
+{
+    Engine                   engine = Engine::Vm;
+    bool                     verbose = false;
+    bool                     optimize = false;
+    bool                     fastMath = false;
+    bool                     associative = false;
+    bool                     exact = false;
+    bool                     embedded = false;
+    bool                     parallel = false;
+    bool                     split = false;
+    bool                     pipelined = false;
+    unsigned                 threads = 0;
+    unsigned                 repeat = 1;
+    std::vector<const char*> queries;
+};
+
+using NodeId = uint32_t;
+
+class SymbolTable;
+
+// The expression of a statement as a flat array of nodes, kept as parallel arrays so that a node takes
+// ten bytes, plus its entry in the hash table. Children are always appended before their parent, so
+// evaluating the nodes in index order computes every operand before it is used. Nodes are hash-consed:
+// making a node that already exists returns the existing one, so a repeated subexpression is a single node
+// and the tree is really a DAG. Constant nodes keep the index of their value in constants in lhs, and
+// Variable nodes keep the variable's slot. The Make functions fold operations on constants as the parser
+// builds the tree, so a subtree made up only of literals is always a single Constant, and with -O they
+// also apply algebraic identities.
+//
+// Sharing also means a variable that hasn't been assigned is no longer reported once per occurrence in the
+// text: it is a single node, so every engine reports it once per statement.
+//
+// Evaluate() memoizes: each node caches its last result along with the newest version of any variable
+// that result was computed from, so a shared node is computed once per evaluation. Every assignment takes
+// a new version from a global counter, so a changed input is always newer than any cached result, and a
+// node is only recomputed when something it reads is newer than its own result. The memo arrays are only
+// filled in by Evaluate(), so the other engines don't carry them.
+class Ast
+{
+public:
+    enum Op : uint8_t
+    {
+	Constant,
+	Variable,
+	Neg,
+	Add,
+	Sub,
+	Mul,
+	Div
+    };
+
+    Ast(const Options& opts, SymbolTable& s, Output& o) : options(opts), symbols(s), out(o) {}
+
+    NodeId MakeConstant(double d);
+    NodeId MakeVariable(uint32_t slot);
+    NodeId MakeUnary(Token::Type t, NodeId r);
+    NodeId MakeBinary(Token::Type t, NodeId l, NodeId r);
+
+    NodeId Reassociate(NodeId root);
+    double Evaluate(NodeId root);
+    void   PrintEvaluations(NodeId root) const;
+    void   Clear();
+
+private:
+    friend class Code;
+
+    NodeId   Append(Op o, uint32_t l, uint32_t r);
+    NodeId   Insert(size_t slot, Op o, uint32_t l, uint32_t r);
+    size_t   Home(Op o, uint64_t key) const;
+    size_t   Lookup(Op o, uint64_t key) const;
+    uint64_t Key(NodeId n) const;
+    void     Rehash(size_t size);
+    void     Drop(NodeId n);
+    void     Unlink(NodeId n);
+    void     Mark(NodeId root);
+    NodeId   Negate(NodeId r);
+    NodeId   Binary(Op o, NodeId l, NodeId r);
+    NodeId   Simplify(Op o, NodeId l, NodeId r);
+    bool     IsConstant(NodeId n, double d) const;
+
+    static constexpr NodeId NoNode = UINT32_MAX;
+
+    static double Apply(Op o, double l, double r);
+
+    const Options&                options;
+    SymbolTable&                  symbols;
+    Output&                       out;
+    std::vector<Op>               op;
+    std::vector<uint32_t>         lhs;
+    std::vector<uint32_t>         rhs;
+    std::vector<double>           constants;
+    std::vector<double>           memo;
+    std::vector<uint64_t>         version;
+    std::vector<uint32_t>         evaluations;
+    std::vector<uint8_t>          shared;
+    std::vector<uint8_t>          live;
+    std::vector<NodeId>           table = std::vector<NodeId>(64, NoNode);
+    size_t                        tableUsed = 0;
+};
+
+// Bytecode for a stack machine, compiled from an Ast. Each instruction is an opcode and an operand: the
+// index into constants for PushConst, the variable's slot for LoadVar and Store, and a temporary for Tee
+// and LoadTemp. Tee saves the top of the stack in a temporary, which is how a node the Ast shares is
+// computed only once. Store is always the last instruction.
+class Code
+{
+public:
+    enum Op : uint8_t
+    {
+	PushConst,
+	LoadVar,
+	LoadTemp,
+	Tee,
+	Neg,
+	Add,
+	Sub,
+	Mul,
+	Div,
+	Store
+    };
+
+    struct Instr
+    {
+	Op       op;
+	uint32_t arg;
+    };
+
+    Code(SymbolTable& s, Output& o) : symbols(s), out(o) {}
+
+    void   Compile(const Ast& ast, NodeId root, uint32_t target);
+    double Run();
+    size_t Ops() const { return code.size() - 1; }
+
+    // Whether Compile() reports variables read before they are assigned. A piece of a script parsed on its
+    // own can't tell, so it leaves that to the session that puts the pieces together, which calls Report()
+    // once the slots are its own.
+    bool check = true;
+    void Report();
+
+    static double Exec(const Instr* ip, const double* constants, const double* vars, double* stack,
+		       double* temps);
+
+private:
+    friend class Jit;
+    friend class Program;
+    friend class Session;
+
+    void Emit(Op op, uint32_t arg = 0) { code.push_back({ op, arg }); }
+    void Load(const Ast& ast, NodeId n);
+
+    static constexpr uint32_t NoTemp = UINT32_MAX;
+
+    SymbolTable&                  symbols;
+    Output&                       out;
+    std::vector<Instr>            code;
+    std::vector<double>           constants;
+    std::vector<double>           stack;
+    std::vector<double>           temps;
+    std::vector<uint32_t>         uses;
+    std::vector<uint32_t>         temp;
+    std::vector<std::pair<NodeId, uint8_t>> work;
+    std::vector<std::pair<uint32_t, size_t>> unassigned;
+};
+
+// Interns variable names into dense slots. The parser resolves every identifier once, and evaluation then
+// reads and writes values[slot] directly. A slot's value is 0 until the variable is first assigned.
+//
+// The names are found through an open-addressing hash table with linear probing. Each entry keeps the
+// name's hash next to its slot, so a probe runs through a contiguous array and only compares names when
+// the hashes match, and growing the table never rehashes a name. The names themselves are copied into
+// blocks that are never moved or freed, so the views Name() returns stay valid.
+class SymbolTable
+{
+public:
+    uint32_t         Intern(std::string_view name);
+    uint32_t         Lookup(std::string_view name) const;
+    std::string_view Name(uint32_t slot) const { return names[slot]; }
+    std::tuple<bool, double> Find(uint32_t slot, Output& out) const;
+    void                     Assign(uint32_t slot, double value);
+
+    static uint32_t Hash(std::string_view name);
+
+    static constexpr uint32_t NoSlot = UINT32_MAX;
+
+    std::vector<double>   values;
+    std::vector<uint8_t>  defined;
+    std::vector<uint64_t> versions;
+    uint64_t              version = 1;
+
+private:
+    static constexpr size_t BlockSize = 64 * 1024;
+
+    struct Entry
+    {
+	uint32_t hash;
+	uint32_t slot;
+    };
+
+    void             Grow();
+    std::string_view Store(std::string_view name);
+
+    std::vector<Entry>                   table = std::vector<Entry>(1024, Entry{ 0, NoSlot });
+    std::vector<std::string_view>        names;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char*                                blockNext = nullptr;
+    size_t                               blockLeft = 0;
+};
+
+// Compiles bytecode to x86-64 SSE2 machine code. The bytecode's stack slots map to xmm0-xmm14 and anything
+// deeper spills to memory, so the result ends up in xmm0. Temporaries live in the same memory, after the
+// spill slots. The generated function takes the variable table as a base pointer; Store is left to the
+// caller. Compile() fails on other targets, or if the system won't give us executable memory, and the
+// caller then runs the bytecode.
+class Jit
+{
+public:
+    ~Jit();
+
+    bool   Compile(const Code& c);
+    double Run(const double* vars) { return fn(vars, spill.data()); }
+
+private:
+    static constexpr int Regs = 15;
+    static constexpr int Scratch = 15;
+    static constexpr int Rsi = 6;
+    static constexpr int Rdi = 7;
+
+    void    Byte(uint8_t b) { buf.push_back(b); }
+    void    Disp(int32_t d);
+    void    SseReg(uint8_t prefix, uint8_t opcode, int reg, int rm);
+    void    SseMem(uint8_t prefix, uint8_t opcode, int reg, int base, int32_t disp);
+    void    MovRaxImm(uint64_t imm);
+    void    MovXmmRax(int xmm);
+    void    MovRaxMem(int base, int32_t disp);
+    void    MovMemRax(int base, int32_t disp);
+    int32_t SpillOffset(size_t depth) const { return int32_t(depth - Regs) * 8; }
+    int32_t TempOffset(uint32_t t) const { return int32_t(spills + t) * 8; }
+    bool    Install();
+    void    Unmap();
+
+    std::vector<uint8_t> buf;
+    std::vector<double>  spill;
+    void*                writable = MAP_FAILED;
+    void*                executable = MAP_FAILED;
+    size_t               memSize = 0;
+    size_t               spills = 0;
+    double (*fn)(const double* vars, double* spill) = nullptr;
+};
+
+// A whole script compiled up front, for -p. Each variable reference is resolved to the statement that last
+// assigned the variable: statement i stores its result in results[i + 1], and results[0] is the 0 that a
+// variable read before any assignment gets. A statement then only depends on the statements it reads, and
+// Run() evaluates them in dependency order on a pool of threads that steal work from each other. Whatever
+// the parser printed for a statement is kept with it, and Print() writes it all out in script order.
+//
+// Instead of a run, Query() evaluates just the statements a variable's value depends on, each at most once.
+// That is what -q uses.
+//
+// After a run the program can be patched: Redefine() replaces a variable's last assignment, and Update()
+// then recomputes only what that affects. A statement only ever reads earlier ones, so the edges always
+// point forwards and script order is a topological order.
+class Program
+{
+public:
+    Program(SymbolTable& s, Output& o) : symbols(s), out(o) {}
+
+    void     Add(const Code& c);
+    void     Note(std::string_view text) { log += text; }
+    void     Run(unsigned threads);
+    void     Print() const;
+    void     Redefine(const Code& c);
+    void     Update();
+    void     Query(std::string_view name);
+    uint64_t Ops() const { return code.size() - starts.size(); }
+
+private:
+    // The statements that are ready to run on one thread. Its owner works from the front and thieves take
+    // from the back, so they seldom contend for the same end.
+    struct Worker
+    {
+	std::mutex           lock;
+	std::deque<uint32_t> ready;
+    };
+
+    double Exec(uint32_t s, double* stack, double* temps) const;
+    void   Work(unsigned self, unsigned threads);
+    bool   Next(unsigned self, unsigned threads, uint32_t& s);
+    void   Queue(uint32_t s, uint8_t how);
+    void   Force(uint32_t s);
+
+    static constexpr uint8_t Queued = 1;
+    static constexpr uint8_t Added = 2;
+
+    SymbolTable&             symbols;
+    Output&                  out;
+    std::vector<Code::Instr> code;
+    std::vector<double>      constants;
+    std::vector<uint32_t>    starts;
+    std::vector<uint32_t>    deps;
+    std::vector<uint32_t>    depEnds;
+    std::vector<uint32_t>    lastDef;
+    std::vector<uint32_t>    targets;
+    std::string              log;
+    std::vector<size_t>      logEnds;
+    size_t                   maxStack = 0;
+    size_t                   maxTemps = 0;
+
+    std::vector<double>                      results;
+    std::vector<uint32_t>                    users;
+    std::vector<uint32_t>                    userStarts;
+    std::unique_ptr<std::atomic<uint32_t>[]> pending;
+    std::unique_ptr<Worker[]>                workers;
+    std::atomic<size_t>                      left;
+
+    // The statements assigning each variable, in script order, and the dependencies that redefinitions
+    // have added since the run; those they removed stay in users, where they only cost a recomputation.
+    // Update() works through heap in script order, and queued marks what is in it.
+    std::vector<std::vector<uint32_t>> defs;
+    std::multimap<uint32_t, uint32_t>  extraUsers;
+    std::vector<uint32_t>              heap;
+    std::vector<uint8_t>               queued;
+
+    std::vector<uint8_t>  done;
+    std::vector<uint32_t> pendingWork;
+};
+
+// Reads the input in large blocks with read(2). The lexer scans the range [cur, end) directly and only
+// calls Refill() when it has consumed the whole block. A file given on the command line is instead mapped
+// in its entirety with Map(), in which case [cur, end) is the whole file and Refill() never succeeds, and
+// Set() likewise makes it text that is already in memory. InMemory() tells whether the rest of the input
+// is all in [cur, end).
+//
+// Tokens refer to their text in place, so everything from mark onwards stays valid and at the same
+// address until the next Release(): a refill carries that text over into a fresh block and keeps the old
+// block alive. The parser releases at every statement boundary, so a token lives as long as its statement.
+class Input
+{
+public:
+    Input(int f, Output& o) : fd(f), out(o) {}
+    ~Input();
+
+    bool Map(const char* path);
+    void Set(std::string_view text);
+    void Close();
+    bool Refill();
+    void Release();
+    bool InMemory() const { return eof; }
+    int  Fd() const { return fd; }
+
+    const char* cur = nullptr;
+    const char* end = nullptr;
+    const char* mark = nullptr;
+
+private:
+    static constexpr size_t BlockSize = 1 << 20;
+
+    int               fd;
+    Output&           out;
+    bool              ownFd = false;
+    bool              eof = false;
+    std::vector<char> buf;
+    std::vector<char> spare;
+    std::vector<std::vector<char>> retired;
+    void*             mapped = nullptr;
+    size_t            mappedSize = 0;
+};
+
+Output& operator<<(Output& o, const Token& x);
+
+// Waits a little longer each time it is called again, n counting the calls: first by spinning, then by
+// yielding, then by sleeping.
+void Backoff(unsigned n);
+
+// A bounded queue from one thread to one other without locks. Push() waits while it is full and Pop() while
+// it is empty, so a producer that gets ahead of its consumer is held back rather than queueing up without
+// limit. The size must be a power of two.
+template <class T>
+class Ring
+{
+public:
+    explicit Ring(size_t size) : slots(size) {}
+
+    bool TryPush(T& item)
+    {
+	size_t t = tail.load(std::memory_order_relaxed);
+	if (t - head.load(std::memory_order_acquire) == slots.size())
+	{
+	    return false;
+	}
+	slots[t & (slots.size() - 1)] = std::move(item);
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+    }
+
+    bool TryPop(T& item)
+    {
+	size_t h = head.load(std::memory_order_relaxed);
+	if (tail.load(std::memory_order_acquire) == h)
+	{
+	    return false;
+	}
+	item = std::move(slots[h & (slots.size() - 1)]);
+	head.store(h + 1, std::memory_order_release);
+	return true;
+    }
+
+    void Push(T item)
+    {
+	for (unsigned n = 0; !TryPush(item); n++)
+	{
+	    Backoff(n);
+	}
+    }
+
+    T Pop()
+    {
+	T item;
+	for (unsigned n = 0; !TryPop(item); n++)
+	{
+	    Backoff(n);
+	}
+	return item;
+    }
+
+private:
+    std::vector<T>                  slots;
+    alignas(64) std::atomic<size_t> head{ 0 };
+    alignas(64) std::atomic<size_t> tail{ 0 };
+};
+
+// One run of the parser over one script: the input, the lookahead token, the variables, what the script
+// compiles to and where the output goes. Sessions share nothing, so several can run at once on different
+// threads.
+class Session
+{
+public:
+    Session(int in, int outFd, const Options& o);
+
+    bool Open(const char* path) { return input.Map(path); }
+    void Parse();
+    bool Patch(const char* path);
+    void Lex();
+
+    // For embedded sessions: Load() makes text the input for the next Parse(), which then leaves the
+    // target and value of each statement in Results(). A last statement that runs into the end of the text
+    // might go on in text loaded later, so it is neither run nor reported, and Unparsed() is the length of
+    // the text it takes up. Messages() takes what the parser has reported.
+    void               Load(std::string_view text);
+    const SymbolTable& Symbols() const { return symbols; }
+    const std::vector<std::pair<uint32_t, double>>& Results() const { return results; }
+    size_t             Unparsed() const { return unparsed; }
+    std::string        Messages();
+
+private:
+    using Scanner = const char* (*)(const char*, const char*);
+
+    // What ParseExpr() has read but not applied yet: a sign, a binary operator, an opening parenthesis, or
+    // a token that is out of place, which is dropped along with the operand after it.
+    struct Pending
+    {
+	enum Kind : uint8_t
+	{
+	    Sign,
+	    Binary,
+	    Group,
+	    Stray
+	};
+	Kind  kind;
+	Token token;
+    };
+
+    // The statements of one piece of a script split up by -P, compiled by a session of its own, whose slots
+    // the code refers to. Each statement's log is what parsing it reported, and whatever is left of the log
+    // came after the last one. names are the names of those slots, in order, up to the last statement's
+    // nameEnd. A piece is clean unless its last statement ran into the end of the piece.
+    struct Chunk
+    {
+	struct Statement
+	{
+	    size_t   codeEnd;
+	    size_t   constantEnd;
+	    size_t   logEnd;
+	    size_t   nameEnd;
+	    uint32_t stack;
+	    uint32_t temps;
+	};
+	std::vector<Code::Instr>      code;
+	std::vector<double>           constants;
+	std::vector<Statement>        statements;
+	std::string                   log;
+	std::vector<std::string_view> names;
+	bool                          last = false;
+	bool                          clean = true;
+    };
+
+    // The stages of -s: a lexer session sends batches of tokens to a parser session, which sends batches of
+    // compiled statements on to this one to run. A batch of tokens has their text copied into it, and what
+    // the lexer reported before each one. Batches that have been used go back to be filled again.
+    struct Pipeline
+    {
+	struct Tokens
+	{
+	    std::vector<Token>  tokens;
+	    std::vector<size_t> logEnds;
+	    std::string         text;
+	    std::string         log;
+	};
+	Ring<std::unique_ptr<Tokens>> tokens{ 8 };
+	Ring<std::unique_ptr<Tokens>> spareTokens{ 16 };
+	Ring<std::unique_ptr<Chunk>>  statements{ 8 };
+	Ring<std::unique_ptr<Chunk>>  spareStatements{ 16 };
+    };
+
+    bool             More(const char*& start, const char*& p);
+    void             Skip(const char*& start, const char*& p, Scanner scanner);
+    int              At(const char*& start, const char*& p, ptrdiff_t k);
+    std::string_view ScanRun(const char* start, Scanner scanner);
+    std::string_view ScanNumber(const char* start);
+    Token            GetNextToken();
+    Token            GetToken();
+    void             NextToken();
+    double           ToDouble(std::string_view val);
+    bool             Expect(Token::Type ty, Token& t);
+    NodeId           ParseExpr();
+    bool             Complete();
+    void             Reduce(unsigned prec);
+    double           Evaluate(NodeId root, uint32_t target, uint64_t& ops,
+			      std::chrono::duration<double>& time);
+    double           Execute(uint64_t& ops);
+    void             ParseStatements(uint64_t& ops, std::chrono::duration<double>& time);
+    void             ParseSplit(uint64_t& ops, std::chrono::duration<double>& time);
+    void             ParsePipelined(uint64_t& ops, std::chrono::duration<double>& time);
+    void             LexInto(Pipeline& pipe);
+    Token            Receive();
+    void             Send();
+
+    const Options options;
+    Output        out;
+    SymbolTable   symbols;
+    Ast           ast;
+    Code          code;
+    Jit           jit;
+    Program       program;
+    Input         input;
+    Token         curToken;
+    bool          curValid = false;
+
+    std::vector<NodeId>                      operands;
+    std::vector<Pending>                     operators;
+    std::vector<std::pair<uint32_t, double>> results;
+    size_t                                   unparsed = 0;
+    std::string                              messages;
+    std::unique_ptr<Chunk>                   chunk;
+    uint32_t                                 named = 0;
+
+    Pipeline*                                      pipeline = nullptr;
+    std::unique_ptr<Pipeline::Tokens>              received;
+    size_t                                         receivedNext = 0;
+    size_t                                         receivedLog = 0;
+    std::vector<std::unique_ptr<Pipeline::Tokens>> held;
+};
@@ -0,0 +1,199 @@
+#include "cp.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+void Usage(const std::string& msg, const std::string& option = "")
+{
+    if (msg != "")
+    {
+	std::cerr << msg;
+	if (option != "")
+	{
+	    std::cerr << ":" << option;
+	}
+	std::cerr << "\n\n";
+    }
+    std::cerr << "Usage: constparser [options] [file]\n";
+    std::cerr << "Reads from standard input when no file is given.\n\n";
+    std::cerr << "Options available:\n";
+    std::cerr << "-v     Enable verbose mode" << std::endl;
+    std::cerr << "-l     Only run the lexer (for benchmarking)" << std::endl;
+    std::cerr << "-e engine  Evaluate with 'vm' (bytecode, the default) or 'ast' (walk the nodes, memoizing"
+	      << std::endl;
+    std::cerr << "           results between evaluations). 'jit' compiles to x86-64 code, falling back to"
+	      << std::endl;
+    std::cerr << "           'vm' where that isn't available" << std::endl;
+    std::cerr << "-O         Simplify expressions with algebraic identities that don't change any result"
+	      << std::endl;
+    std::cerr << "-ffast-math  Also use identities that may change results for infinities, NaNs, signed"
+	      << std::endl;
+    std::cerr << "           zeros or by rounding (implies -O and -fassociative-math)" << std::endl;
+    std::cerr << "-fassociative-math  Evaluate chains of + and of * as balanced trees" << std::endl;
+    std::cerr << "-p threads Parse the whole script first, then evaluate statements that don't depend on each"
+	      << std::endl;
+    std::cerr << "           other in parallel on threads threads, at most one per CPU (0 for one per CPU)"
+	      << std::endl;
+    std::cerr << "-P         With -p, split a script file into a piece per thread at statement boundaries and"
+	      << std::endl;
+    std::cerr << "           lex and parse the pieces in parallel too" << std::endl;
+    std::cerr << "-s         Lex, parse and evaluate on three threads, so that reading, parsing and"
+	      << std::endl;
+    std::cerr << "           evaluating a stream overlap (not with -p or -e ast)" << std::endl;
+    std::cerr << "-q name    Only print the value of name as name=value, evaluating just what it needs"
+	      << std::endl;
+    std::cerr << "           (may be repeated)" << std::endl;
+    std::cerr << "-u patch   Then redefine variables with the assignments in patch and print the values that"
+	      << std::endl;
+    std::cerr << "           change, as name=value (may be repeated; implies -p if not given)" << std::endl;
+    std::cerr << "-r         Print values with as many digits as it takes to read them back exactly, rather"
+	      << std::endl;
+    std::cerr << "           than rounded to six" << std::endl;
+    std::cerr << "-n count   Evaluate each statement count times and report the speed (for benchmarking)"
+	      << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    Options                  options;
+    const char*              file = nullptr;
+    std::vector<const char*> patches;
+    bool                     lexOnly = false;
+    for (int i = 1; i < argc; i++)
+    {
+	if (argv[i][0] != '-')
+	{
+	    if (file)
+	    {
+		Usage("Only one input file allowed", argv[i]);
+		exit(1);
+	    }
+	    file = argv[i];
+	    continue;
+	}
+	const std::string a = argv[i];
+	if (a == "-v")
+	{
+	    options.verbose = true;
+	}
+	else if (a == "-l")
+	{
+	    lexOnly = true;
+	}
+	else if (a == "-e" && i + 1 < argc)
+	{
+	    const std::string e = argv[++i];
+	    if (e == "vm")
+	    {
+		options.engine = Engine::Vm;
+	    }
+	    else if (e == "ast")
+	    {
+		options.engine = Engine::Ast;
+	    }
+	    else if (e == "jit")
+	    {
+		options.engine = Engine::Jit;
+	    }
+	    else
+	    {
+		Usage("Invalid engine", e);
+		exit(1);
+	    }
+	}
+	else if (a == "-O")
+	{
+	    options.optimize = true;
+	}
+	else if (a == "-fassociative-math")
+	{
+	    options.associative = true;
+	}
+	else if (a == "-ffast-math")
+	{
+	    options.optimize = true;
+	    options.fastMath = true;
+	    options.associative = true;
+	}
+	else if (a == "-p" && i + 1 < argc)
+	{
+	    errno = 0;
+	    const char* t = argv[++i];
+	    char*       end;
+	    long        n = strtol(t, &end, 10);
+	    if (end == t || *end != '\0' || n < 0)
+	    {
+		Usage("Invalid thread count", t);
+		exit(1);
+	    }
+	    // Threads beyond the CPUs only take turns, so there is no point in starting more.
+	    unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+	    options.parallel = true;
+	    options.threads = n == 0 || errno == ERANGE ? cpus : std::min<long>(n, cpus);
+	}
+	else if (a == "-P")
+	{
+	    options.split = true;
+	}
+	else if (a == "-s")
+	{
+	    options.pipelined = true;
+	}
+	else if (a == "-q" && i + 1 < argc)
+	{
+	    options.queries.push_back(argv[++i]);
+	}
+	else if (a == "-u" && i + 1 < argc)
+	{
+	    patches.push_back(argv[++i]);
+	}
+	else if (a == "-r")
+	{
+	    options.exact = true;
+	}
+	else if (a == "-n" && i + 1 < argc)
+	{
+	    options.repeat = std::max(1, atoi(argv[++i]));
+	}
+	else
+	{
+	    Usage("Invalid option", a);
+	}
+    }
+
+    if (!patches.empty() && !options.queries.empty())
+    {
+	Usage("Can't combine -q and -u");
+	exit(1);
+    }
+    if ((!patches.empty() || !options.queries.empty()) && !options.parallel)
+    {
+	options.parallel = true;
+	options.threads = 1;
+    }
+
+    Session session(STDIN_FILENO, STDOUT_FILENO, options);
+    if (file && !session.Open(file))
+    {
+	return 1;
+    }
+    if (lexOnly)
+    {
+	session.Lex();
+	return 0;
+    }
+    session.Parse();
+    for (const char* patch : patches)
+    {
+	if (!session.Patch(patch))
+	{
+	    return 1;
+	}
+    }
+    return 0;
+}
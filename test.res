@@ -0,0 +1,38 @@
+a=10
+b=12
+c=19
+d=-10
+e=-2
+f=3
+g=8
+h=26
+j=25
+k=3
+l=16.5
+m=1
+n=-5
+o=-3
+p=6
+q=24
+q=1152
+r=10
+s=66
+t=3744
+u=44
+v=9.28571
+w=10
+x=9
+y=-8
+z=11
+Error: Missing ')'
+aa=1
+Invalid variable aa
+ab=-9
+Error, unknown token
+nn=-nan
+na=-nan
+nb=nan
+nc=nan
+nd=-nan
+h is 26
+zz is not set